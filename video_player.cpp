@@ -32,20 +32,83 @@
  *  - Hardware decoding (VAAPI / VideoToolbox / DXVA2)
  *  - Audio via SDL2
  *  - Seeking with ImGui progress bar
- *  - YUV-to-RGB via OpenGL (inspired by vlc-warp opengl.c)
+ *  - Gapless playlists (next clip pre-opened and pre-rolled)
+ *  - Seamless loop mode (first second kept decoded)
+ *  - Whole-clip RAM preload behind a custom AVIOContext
+ *  - Readahead I/O (io_uring or thread pool) behind a custom AVIOContext,
+ *    optionally O_DIRECT so huge masters bypass the page cache
+ *  - Independent audio reader for badly interleaved files
+ *  - Stream selection by index or language, the rest discarded at the demuxer
+ *  - Adaptive decode degradation when the decoder falls behind
+ *  - Frames presented by timestamp, late ones dropped before conversion
+ *  - Pause, frame stepping and reverse play from a GOP-aware frame cache
+ *  - 0.5x-4x playback speed, audio time-stretched (WSOLA) at constant pitch
+ *  - Video slaved to an audio clock taken from the SDL callbacks and the
+ *    device latency
+ *  - Audio device drift measured in ppm, optionally absorbed by the resampler
+ *  - Projector outputs: shared-context windows, each with its own warp mesh
+ *    and edge-blend mask (gamma-correct, with black-level lift)
+ *  - YUV-to-RGB via OpenGL (inspired by vlc-warp opengl.c), matrix and range
+ *    taken from each stream's colour tags
+ *  - HDR10 / HLG tone-mapped to SDR and BT.2020 gamut-mapped in the same pass
+ *  - Planes beyond GL_MAX_TEXTURE_SIZE stored as tiles of a texture array
+ *  - Uploads run ahead of presentation through a ring of 3 texture sets
+ *    (optionally on an upload thread with a shared context and GLsync fences)
+ *  - Mosaic: N synchronised files decoded on N threads into one frame
+ *  - Numbered image sequences decoded ahead by a thread pool
+ *  - Hap / Hap Q / Hap R: DXT and BC7 blocks uploaded as compressed
+ *    textures, nothing decoded on the CPU but Snappy
+ *  - Headless mode: EGL surfaceless context rendering into an FBO, with
+ *    frame-time statistics and pixel readback
+ *  - Golden-image tests of every pixel-format path and warp mode
  * ------------------------------------------------------------- */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <math.h>
 #include <stdbool.h>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#ifdef HAVE_SNAPPY
+#include <snappy-c.h>
+#endif
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
 #include <libavutil/hwcontext.h>
+#include <libavutil/mastering_display_metadata.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+}
 
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
@@ -65,42 +128,711 @@
 /* -------------------------------------------------------------
  *  OpenGL: shaders, quad, textures
  * ------------------------------------------------------------- */
+/* Mesh coordinates follow the warp files: uv (0,0) is the bottom left of
+ * the picture, i scales the brightness of the vertex */
 static const char *vs_src = "#version 330 core\n"
-    "layout(location=0) in vec2 p; layout(location=1) in vec2 uv;\n"
-    "out vec2 vUV; void main(){ gl_Position=vec4(p,0,1); vUV=uv; }\n";
+    "layout(location=0) in vec2 p; layout(location=1) in vec2 uv; layout(location=2) in float i;\n"
+    "out vec2 vUV; out float vI;\n"
+    "void main(){ gl_Position=vec4(p,0,1); vUV=vec2(uv.x,1.0-uv.y); vI=i; }\n";
 
+/* Planes are texture arrays, one layer per tile. t is (plane w, h, tile
+ * core w, h); each layer holds its core plus an apron of neighbouring
+ * texels, so bilinear filtering never sees a seam. Clamping to half a
+ * texel inside the plane stands in for CLAMP_TO_EDGE.
+ * HDR: PQ or HLG is linearised to nits, luminance is tone-mapped so that
+ * sdr_white becomes 1.0 (clip, Reinhard, Hable or the BT.2390 EETF),
+ * BT.2020 is converted to BT.709 primaries and BT.1886 re-applied.
+ * Blending: the mask (linear light, in projector pixels) is applied
+ * through the projector's gamma, so overlapping projectors add up to the
+ * same picture. Black is lifted only where the mask is full: there one
+ * projector's floor plus the lift matches the two floors of an overlap.
+ * Hap frames skip the planes: one compressed RGB(A) texture, or scaled
+ * YCoCg in DXT5 for Hap Q (Co, Cg, scale, Y in r, g, b, a). */
 static const char *fs_src = "#version 330 core\n"
-    "in vec2 vUV; out vec4 c;\n"
-    "uniform sampler2D y,u,v;\n"
+    "in vec2 vUV; in float vI; out vec4 c;\n"
+    "uniform sampler2DArray y,uv; uniform sampler2D mask;\n"
+    "uniform vec4 y_tiles, uv_tiles; uniform float y_apron, uv_apron;\n"
+    "uniform mat3 yuv_mat; uniform vec3 yuv_off;\n"
+    "uniform int transfer, tonemap; uniform bool gamut; uniform float src_peak, sdr_white;\n"
+    "uniform bool blend; uniform vec2 viewport; uniform vec3 gamma, black;\n"
+    "uniform int hap; uniform sampler2D hap_tex; uniform vec2 hap_scale;\n"
+    "const float M1=0.1593017578125, M2=78.84375, C1=0.8359375, C2=18.8515625, C3=18.6875;\n"
+    "const mat3 BT2020_TO_709 = mat3(1.6605,-0.1246,-0.0182, -0.5876,1.1329,-0.1006, -0.0728,-0.0083,1.1187);\n"
+    "vec3 pq_eotf(vec3 e){ vec3 p=pow(max(e,0.0),vec3(1.0/M2));\n"
+    "  return 10000.0*pow(max(p-C1,0.0)/(C2-C3*p),vec3(1.0/M1)); }\n"
+    "float pq_oetf(float n){ float p=pow(max(n,0.0)/10000.0,M1); return pow((C1+C2*p)/(1.0+C3*p),M2); }\n"
+    "vec3 hlg_eotf(vec3 e){\n"
+    "  vec3 s=mix(e*e/3.0,(exp((e-0.55991073)/0.17883277)+0.28466892)/12.0,step(0.5,e));\n"
+    "  return 1000.0*s*pow(max(dot(s,vec3(0.2627,0.6780,0.0593)),1e-6),0.2); }\n"
+    "vec4 tiled(sampler2DArray s, vec2 uv, vec4 t, float apron){\n"
+    "  vec2 p=clamp(uv*t.xy,vec2(0.5),t.xy-0.5), n=ceil(t.xy/t.zw), i=min(floor(p/t.zw),n-1.0);\n"
+    "  return texture(s, vec3((p-i*t.zw+apron)/(t.zw+2.0*apron), i.y*n.x+i.x)); }\n"
+    "vec3 ycocg(vec4 t){ float s=t.b*(255.0/8.0)+1.0, co=(t.r-0.501961)/s, cg=(t.g-0.501961)/s;\n"
+    "  return vec3(t.a+co-cg, t.a+cg, t.a-co-cg); }\n"
+    "float hable(float x){ return (x*(0.15*x+0.05)+0.004)/(x*(0.15*x+0.5)+0.06)-0.0666667; }\n"
+    "float tone(float l){\n"
+    "  float w=l/sdr_white, p=src_peak/sdr_white;\n"
+    "  if (tonemap==1) return w*(1.0+w/(p*p))/(1.0+w);\n"
+    "  if (tonemap==2) return hable(w)/hable(p);\n"
+    "  if (tonemap==3) {\n"
+    "    float sp=pq_oetf(src_peak), e=pq_oetf(l)/sp, ml=pq_oetf(sdr_white)/sp, ks=1.5*ml-0.5;\n"
+    "    if (e>ks) { float t=(e-ks)/(1.0-ks), t2=t*t, t3=t2*t;\n"
+    "      e=(2.0*t3-3.0*t2+1.0)*ks+(t3-2.0*t2+t)*(1.0-ks)+(3.0*t2-2.0*t3)*ml; }\n"
+    "    return pq_eotf(vec3(e*sp)).r/sdr_white; }\n"
+    "  return min(w,1.0);\n"
+    "}\n"
     "void main(){\n"
-    "  float Y = texture(y,vUV).r;\n"
-    "  float U = texture(u,vUV).r-0.5;\n"
-    "  float V = texture(v,vUV).r-0.5;\n"
-    "  c = vec4(Y+1.402*V, Y-0.344*U-0.714*V, Y+1.772*U, 1);\n"
+    "  vec3 rgb;\n"
+    "  if (hap!=0) {\n"
+    "    vec4 t = texture(hap_tex, vUV*hap_scale);\n"
+    "    rgb = clamp(hap==2 ? ycocg(t) : hap==3 ? t.rrr : t.rgb, 0.0, 1.0);\n"
+    "  } else {\n"
+    "    vec3 yuv = vec3(tiled(y,vUV,y_tiles,y_apron).r, tiled(uv,vUV,uv_tiles,uv_apron).rg) - yuv_off;\n"
+    "    rgb = clamp(yuv_mat*yuv, 0.0, 1.0);\n"
+    "  }\n"
+    "  if (transfer!=0 || gamut) {\n"
+    "    vec3 lin = transfer==1 ? pq_eotf(rgb) : transfer==2 ? hlg_eotf(rgb) : pow(rgb,vec3(2.4))*sdr_white;\n"
+    "    if (transfer!=0) {\n"
+    "      float l = dot(lin, gamut ? vec3(0.2627,0.6780,0.0593) : vec3(0.2126,0.7152,0.0722));\n"
+    "      lin *= l>0.0 ? tone(l)*sdr_white/l : 0.0;\n"
+    "    }\n"
+    "    lin /= sdr_white;\n"
+    "    if (gamut) lin = BT2020_TO_709*lin;\n"
+    "    rgb = pow(clamp(lin,0.0,1.0), vec3(1.0/2.4));\n"
+    "  }\n"
+    "  rgb *= vI;\n"
+    "  if (blend) {\n"
+    "    vec2 m = gl_FragCoord.xy/viewport;\n"
+    "    vec3 w = texture(mask,vec2(m.x,1.0-m.y)).rgb;\n"
+    "    float solo = step(254.5/255.0, min(w.r,min(w.g,w.b)));\n"
+    "    rgb = (black*solo + rgb*(1.0-black)) * pow(w, 1.0/gamma);\n"
+    "  }\n"
+    "  c = vec4(rgb, 1);\n"
     "}\n";
 
-static GLuint prog, vao, vbo, ebo, texY, texU, texV;
-static GLint locY, locU, locV;
+static GLuint prog, vao, vbo, ebo;
+static GLint locY, locUV, locYuvMat, locYuvOff, locBlend, locViewport, locGamma, locBlack;
+static GLint locTransfer, locTonemap, locGamut, locSrcPeak, locSdrWhite;
+static GLint locYTiles, locUVTiles, locYApron, locUVApron;
+static GLint locHap, locHapScale;
 
 /* -------------------------------------------------------------
  *  Video state
  * ------------------------------------------------------------- */
-static AVFormatContext *fmt = NULL;
-static AVCodecContext  *vdec = NULL, *adec = NULL;
-static int vidx = -1, aidx = -1;
-static AVFrame *vframe = NULL, *aframe = NULL;
-static AVPacket pkt;
-static struct SwsContext *sws = NULL;
-static double duration = 0.0, pts = 0.0;
+#define PREROLL_FRAMES 3
+#define LOOP_HEAD_SECONDS 1.0
+#define LOOP_HEAD_MAX 240
+#define AUDIO_AHEAD 0.5                 // seconds queued by the split audio reader
+
+/* One opened file: demuxer, decoders and converters. Playlist mode keeps
+ * two of these, the one playing and the next one being pre-rolled. */
+struct IoBackend;
+struct Stretch;
+
+typedef struct Clip {
+    const char *path;
+    const struct IoBackend *io;         // NULL: FFmpeg's own file protocol
+    void *io_opaque, *aio_opaque;
+    AVIOContext *pb, *apb;
+    AVFormatContext *fmt;
+    AVFormatContext *afmt;              // split readers: audio has its own demuxer
+    AVCodecContext  *vdec, *adec;
+    int vidx, aidx;
+    AVPacket *pkt, *apkt;
+    bool aeof;
+    bool video_only;                    // frame cache decoding: audio is ignored
+    AVFrame *vframe, *aframe, *swframe, *nv12;
+    bool hap;                           // Hap packets unpacked to texture blocks, vdec unused
+    AVBufferPool *hap_pool;             // ... into buffers of hap_pool_size
+    size_t hap_pool_size;
+    struct SwsContext *sws;
+    struct SwrContext *swr;
+    double comp_carry;                  // drift compensation not yet applied, samples
+    uint8_t *abuf;                      // converted audio scratch
+    unsigned int abuf_alloc;
+    struct Stretch *stretch;            // time-stretch state, speed != 1
+    double duration;
+    bool eof;
+    bool live;                          // audio goes to the device, not the stash
+    AVFrame *preroll[PREROLL_FRAMES];   // frames decoded ahead of the cut
+    int npreroll, preroll_pos;
+    uint8_t *stash;                     // audio decoded ahead of the cut
+    uint32_t stash_size;
+    double stash_t;                     // media time of its first sample
+    /* Loop mode: the first second stays decoded so EOF can wrap at once */
+    bool caching_head, replaying, pending;
+    AVFrame *head[LOOP_HEAD_MAX];
+    int nhead, replay_pos;
+    int64_t head_start, head_end;       // video pts of the cached span
+    uint8_t *head_audio;
+    uint32_t head_audio_size;
+    double head_audio_end;              // seconds
+    bool audio_skip;                    // drop audio before audio_skip_until
+    double audio_skip_until;
+} Clip;
+
+static Clip clips[2];
+static Clip *cur = &clips[0], *next = NULL;
+static double pts = 0.0;
 static bool seeking = false;
 static int64_t seek_target = 0;
 
+/* -------------------------------------------------------------
+ *  Presentation: frames are shown when the master clock reaches them
+ * ------------------------------------------------------------- */
+#define LATE_SKIP 0.1                   // this far behind, the decoder skips non-ref frames
+#define MAX_DROPS_PER_VSYNC 8           // keep the UI responsive while catching up
+
+enum { DROP_LATE, DROP_DECODER, DROP_SEEK, DROP_CAUSES };
+static const char *drop_cause_name[DROP_CAUSES] = { "late", "skipped in decoder", "before seek point" };
+static uint64_t drops[DROP_CAUSES];
+static bool late_skip = false;
+
+#define SPEED_MIN 0.5
+#define SPEED_MAX 4.0
+#define SPEED_NONREF 2.0                // from here on the decoder skips non-ref frames
+
+static std::atomic<double> speed(1.0);  // read by decode threads for the audio
+static double speed_request = 0.0;
+static double clock_wall = 0.0, clock_media = 0.0;  // media time clock_media at clock_wall
+
+static double media_clock(double now)
+{
+    return clock_media + (now - clock_wall) * speed;
+}
+
+static void set_media_clock(double now, double t)
+{
+    clock_wall = now;
+    clock_media = t;
+}
+
+/* -------------------------------------------------------------
+ *  Playlist
+ * ------------------------------------------------------------- */
+static const char **playlist = NULL;
+static int playlist_len = 0, playlist_pos = 0;
+static std::thread preroll_thread;
+static std::atomic<bool> preroll_done(false);
+static int preroll_status = 0;
+static bool loop_mode = false;
+static bool split_readers = false;
+static int mosaic_cols = 0, mosaic_rows = 0;   // --mosaic: the files are tiles
+static int ntiles = 0;
+static bool seq_active = false;         // playing a numbered image sequence
+static int seq_first = 0, seq_count = 0;
+static double seq_fps = 0.0;            // --fps, 0: the image2 default
+static AVFrame *seq_shown = NULL;       // converted by the pool, on screen
+static const char *vstream_sel = NULL, *astream_sel = NULL;
+static std::thread loop_thread;         // seeks back behind the cached head
+
 /* -------------------------------------------------------------
  *  Audio state (SDL)
  * ------------------------------------------------------------- */
 static SDL_AudioDeviceID audio_dev;
+static SDL_AudioSpec audio_spec;        // format every clip is converted to
 static uint8_t *audio_buf = NULL;
-static uint32_t audio_buf_size = 0, audio_buf_index = 0;
+static uint32_t audio_buf_size = 0, audio_buf_index = 0, audio_buf_alloc = 0;
+
+/* Audio clock: where in the media the device is, from the callbacks */
+#define AUDIO_CLOCK_SMOOTH 16           // callbacks averaged against scheduling jitter
+#define AUDIO_CLOCK_JUMP 0.02           // a larger step is a discontinuity, taken at once
+#define AUDIO_SLAVE_MAX 0.5             // beyond this (stale audio across a cut) video runs free
+
+typedef struct AudioMark {
+    uint64_t pos;                       // byte of the device stream...
+    double t;                           // ...and its media time
+    double rate;                        // media seconds per second played (speed)
+} AudioMark;
+
+static std::deque<AudioMark> audio_marks;  // under the audio device lock, as is all below
+static uint64_t audio_written = 0, audio_read = 0;  // bytes into / out of audio_buf
+static double audio_latency = 0.0;      // device buffer plus --audio-latency, seconds
+static double audio_latency_extra = 0.0;
+static double aclock_offset = NAN;      // media time - rate * wall time, smoothed
+static double aclock_rate = 1.0;
+static double aclock_wall = -INFINITY;  // last callback that played samples
+static double av_correction = 0.0;      // last step of the video clock, for the UI
+
+/* Drift: the device's sample rate against the system clock, from a line
+ * through (wall time, device time - wall time) over the callbacks. With
+ * --drift-comp the resampler absorbs it and video keeps the system clock. */
+#define DRIFT_WINDOW 600.0              // seconds the fit forgets over
+#define DRIFT_MIN_SPAN 30.0             // seconds of callbacks before a figure is given
+#define DRIFT_PULL 10.0                 // seconds to pull an error beyond tolerance back in
+#define DRIFT_MAX_PPM 1000.0            // 0.1%: under 2 cents of pitch
+#define DRIFT_RESYNC 0.04               // beyond this, video steps to the audio instead
+#define DRIFT_LOG 600.0                 // seconds between log lines
+
+static uint64_t audio_consumed = 0;     // bytes the device took, silence included
+static double drift_anchor = NAN, drift_last = 0.0;
+static double drift_sum[5];             // weighted n, x, y, xx, xy
+static double drift_ppm = NAN;          // last figure, kept while the device pauses
+static double drift_tolerance = 0.0;    // --drift-comp, seconds; 0: video slaves instead
+static std::atomic<double> comp_ppm(0.0);  // applied by convert_audio
+
+/* -------------------------------------------------------------
+ *  Custom I/O backends, handed to avformat_open_input as an AVIOContext
+ * ------------------------------------------------------------- */
+#define IO_BUFFER_SIZE (256 * 1024)
+
+typedef struct IoBackend {
+    const char *name;
+    void *(*open)(const char *path);
+    void *(*dup)(void *opaque);         // optional: second reader sharing the data
+    int (*read)(void *opaque, uint8_t *buf, int size);
+    int64_t (*seek)(void *opaque, int64_t offset, int whence);
+    void (*close)(void *opaque);
+    void (*report)(void *opaque);       // extra lines in the Controls window
+} IoBackend;
+
+static const IoBackend *io_backend = NULL;
+
+/* --- Preload: the whole file in locked (huge)pages --- */
+static int64_t preload_limit = 2048LL << 20;
+
+typedef struct MemFile {
+    uint8_t *data;
+    size_t size, map_size, pos;
+    bool huge, locked;
+    bool view;                          // shares another MemFile's data
+} MemFile;
+
+static void mem_close(void *opaque)
+{
+    MemFile *m = (MemFile*)opaque;
+    if (m->data && !m->view) {
+        if (m->locked) munlock(m->data, m->map_size);
+        munmap(m->data, m->map_size);
+    }
+    free(m);
+}
+
+static void *mem_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) { close(fd); return NULL; }
+    if (st.st_size > preload_limit) {
+        fprintf(stderr, "Not preloading %s: %.1f MB is over the %.1f MB limit\n",
+                path, st.st_size / 1048576.0, preload_limit / 1048576.0);
+        close(fd);
+        return NULL;
+    }
+
+    MemFile *m = (MemFile*)calloc(1, sizeof(*m));
+    m->size = st.st_size;
+    m->data = (uint8_t*)MAP_FAILED;
+#ifdef MAP_HUGETLB
+    m->map_size = (m->size + (2 << 20) - 1) & ~(size_t)((2 << 20) - 1);
+    m->data = (uint8_t*)mmap(NULL, m->map_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    m->huge = m->data != MAP_FAILED;
+#endif
+    if (m->data == MAP_FAILED) {
+        m->map_size = m->size ? m->size : 1;
+        m->data = (uint8_t*)mmap(NULL, m->map_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m->data == MAP_FAILED) { m->data = NULL; mem_close(m); close(fd); return NULL; }
+#ifdef MADV_HUGEPAGE
+        madvise(m->data, m->map_size, MADV_HUGEPAGE);  // transparent hugepages if enabled
+#endif
+    }
+
+    for (size_t done = 0; done < m->size; ) {
+        ssize_t n = read(fd, m->data + done, m->size - done);
+        if (n <= 0) { mem_close(m); close(fd); return NULL; }
+        done += n;
+    }
+    close(fd);
+    m->locked = mlock(m->data, m->map_size) == 0;
+    printf("Preloaded %s: %.1f MB, %s pages, %s\n", path, m->size / 1048576.0,
+           m->huge ? "huge" : "normal", m->locked ? "locked" : "not locked (RLIMIT_MEMLOCK?)");
+    return m;
+}
+
+/* The view must be closed before the MemFile it was made from */
+static void *mem_dup(void *opaque)
+{
+    MemFile *v = (MemFile*)malloc(sizeof(*v));
+    *v = *(MemFile*)opaque;
+    v->pos = 0;
+    v->view = true;
+    return v;
+}
+
+static int mem_read(void *opaque, uint8_t *buf, int size)
+{
+    MemFile *m = (MemFile*)opaque;
+    if (m->pos >= m->size) return AVERROR_EOF;
+    size_t n = m->size - m->pos;
+    if (n > (size_t)size) n = size;
+    memcpy(buf, m->data + m->pos, n);
+    m->pos += n;
+    return (int)n;
+}
+
+static int64_t mem_seek(void *opaque, int64_t offset, int whence)
+{
+    MemFile *m = (MemFile*)opaque;
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: return m->size;
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = m->pos + offset; break;
+    case SEEK_END: pos = m->size + offset; break;
+    default: return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > (int64_t)m->size) return AVERROR(EINVAL);
+    m->pos = pos;
+    return pos;
+}
+
+static void mem_report(void *opaque)
+{
+    MemFile *m = (MemFile*)opaque;
+    ImGui::Text("Preloaded: %.1f MB (%s%s)", m->size / 1048576.0,
+                m->huge ? "hugepages" : "4k pages", m->locked ? ", locked" : "");
+}
+
+static const IoBackend preload_io = { "preload", mem_open, mem_dup, mem_read, mem_seek, mem_close, mem_report };
+
+/* --- Readahead: large aligned blocks fetched ahead of the demuxer --- */
+#define RA_BLOCK_SIZE (4 << 20)
+#define RA_ALIGN 4096
+#define RA_WORKERS 2
+
+static int readahead_blocks = 8;        // window = blocks * 4 MB
+static bool readahead_direct = false;   // bypass (or at least drop) the page cache
+
+enum { RA_FREE, RA_PENDING, RA_READY };
+
+typedef struct RaBlock {
+    uint8_t *buf;
+    int64_t offset;
+    int len, state;                     // len < 0: read error
+    int start;                          // io_uring: where the read in flight began
+} RaBlock;
+
+struct Readahead {
+    int fd;
+    bool direct;                        // opened with O_DIRECT
+    bool dontneed;                      // buffered, consumed blocks are dropped
+    int64_t size, pos;
+    RaBlock *blocks;
+    int nblocks;
+    std::mutex lock;
+    std::condition_variable done, todo;
+    std::deque<RaBlock*> queue;         // thread-pool fallback
+    std::vector<std::thread> workers;
+    bool quit;
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    bool uring;
+#endif
+    /* Instrumentation, read by ra_report without the lock */
+    std::atomic<int64_t> bytes{0}, wait_us{0};
+    int64_t rate_bytes, rate_us;        // ra_report's own
+    double rate;
+};
+
+/* After a short read, O_DIRECT can only resume at an aligned offset, so
+ * the tail of what was read is read again. An error after some data
+ * keeps the data. */
+static int ra_resume(const Readahead *r, int len)
+{
+    return r->direct ? len & ~(RA_ALIGN - 1) : len;
+}
+
+static int ra_pread(const Readahead *r, uint8_t *buf, int size, int64_t offset)
+{
+    int done = 0;
+    while (done < size) {
+        int from = ra_resume(r, done);
+        ssize_t n = pread(r->fd, buf + from, size - from, offset + from);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return done ? done : -1;
+        if (from + n <= done) break;    // EOF, or nothing past what we had
+        done = from + (int)n;
+    }
+    return done;
+}
+
+static void ra_worker(Readahead *r)
+{
+    std::unique_lock<std::mutex> lk(r->lock);
+    for (;;) {
+        r->todo.wait(lk, [r] { return r->quit || !r->queue.empty(); });
+        if (r->quit) return;
+        RaBlock *b = r->queue.front();
+        r->queue.pop_front();
+        int64_t offset = b->offset;
+        lk.unlock();
+        int len = ra_pread(r, b->buf, RA_BLOCK_SIZE, offset);
+        lk.lock();
+        b->len = len;
+        b->state = RA_READY;
+        if (len > 0) r->bytes += len;
+        r->done.notify_all();
+    }
+}
+
+#ifdef HAVE_LIBURING
+static void ra_uring_read(Readahead *r, RaBlock *b)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+    b->start = ra_resume(r, b->len);
+    io_uring_prep_read(sqe, r->fd, b->buf + b->start, RA_BLOCK_SIZE - b->start, b->offset + b->start);
+    io_uring_sqe_set_data(sqe, b);
+    io_uring_submit(&r->ring);
+}
+
+static void ra_uring_complete(Readahead *r, struct io_uring_cqe *cqe)
+{
+    RaBlock *b = (RaBlock*)io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+    io_uring_cqe_seen(&r->ring, cqe);
+    if (res > 0 && b->start + res > b->len) {
+        r->bytes += b->start + res - b->len;
+        b->len = b->start + res;
+        /* Short read before EOF: fetch the rest of the block */
+        if (b->len < RA_BLOCK_SIZE && b->offset + b->len < r->size) {
+            ra_uring_read(r, b);
+            return;
+        }
+    } else if (res < 0 && !b->len) {
+        b->len = -1;                    // nothing read; with some data, keep it
+    }
+    b->state = RA_READY;
+}
+#endif
+
+/* Block until at least one outstanding read has finished. The lock is
+ * never held across the wait: only the reader touches the ring, and
+ * nothing else may stall behind its I/O. */
+static void ra_wait_any(Readahead *r, std::unique_lock<std::mutex> &lk)
+{
+#ifdef HAVE_LIBURING
+    if (r->uring) {
+        struct io_uring_cqe *cqe;
+        lk.unlock();
+        int ret = io_uring_wait_cqe(&r->ring, &cqe);
+        lk.lock();
+        if (ret == 0) ra_uring_complete(r, cqe);
+        return;
+    }
+#endif
+    r->done.wait(lk);
+}
+
+/* Make sure the window [base, base + nblocks) is being read and return
+ * the block holding base, or NULL if every buffer is still in flight.
+ * Finished blocks outside the window are recycled. */
+static RaBlock *ra_fill(Readahead *r, int64_t base)
+{
+#ifdef HAVE_LIBURING
+    if (r->uring) {
+        struct io_uring_cqe *cqe;
+        while (io_uring_peek_cqe(&r->ring, &cqe) == 0) ra_uring_complete(r, cqe);
+    }
+#endif
+    int64_t end = base + (int64_t)r->nblocks * RA_BLOCK_SIZE;
+    RaBlock *first = NULL;
+    for (int64_t off = base; off < end && off < r->size; off += RA_BLOCK_SIZE) {
+        RaBlock *b = NULL, *victim = NULL;
+        for (int i = 0; i < r->nblocks; ++i) {
+            RaBlock *k = &r->blocks[i];
+            if (k->state != RA_FREE && k->offset == off) { b = k; break; }
+            if (!victim && (k->state == RA_FREE ||
+                            (k->state == RA_READY && (k->offset < base || k->offset >= end))))
+                victim = k;
+        }
+        if (!b) {
+            if (!victim) break;
+            if (r->dontneed && victim->state == RA_READY)
+                posix_fadvise(r->fd, victim->offset, RA_BLOCK_SIZE, POSIX_FADV_DONTNEED);
+            b = victim;
+            b->offset = off;
+            b->len = 0;
+            b->state = RA_PENDING;
+#ifdef HAVE_LIBURING
+            if (r->uring) ra_uring_read(r, b);
+            else
+#endif
+            {
+                r->queue.push_back(b);
+                r->todo.notify_one();
+            }
+        }
+        if (off == base) first = b;
+    }
+    return first;
+}
+
+static int ra_read(void *opaque, uint8_t *buf, int size)
+{
+    Readahead *r = (Readahead*)opaque;
+    if (r->pos >= r->size) return AVERROR_EOF;
+    int64_t base = r->pos / RA_BLOCK_SIZE * RA_BLOCK_SIZE;
+
+    std::unique_lock<std::mutex> lk(r->lock);
+    RaBlock *b = ra_fill(r, base);
+    if (!b || b->state != RA_READY) {
+        int64_t t0 = av_gettime_relative();
+        while (!b || b->state != RA_READY) {
+            ra_wait_any(r, lk);
+            if (!b) b = ra_fill(r, base);
+        }
+        r->wait_us += av_gettime_relative() - t0;
+    }
+
+    int64_t in = r->pos - base;
+    if (b->len < 0) return AVERROR(EIO);
+    if (b->len <= in) return AVERROR_EOF;
+    int n = b->len - (int)in;
+    if (n > size) n = size;
+    memcpy(buf, b->buf + in, n);
+    r->pos += n;
+    return n;
+}
+
+static int64_t ra_seek(void *opaque, int64_t offset, int whence)
+{
+    Readahead *r = (Readahead*)opaque;
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: return r->size;
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = r->pos + offset; break;
+    case SEEK_END: pos = r->size + offset; break;
+    default: return AVERROR(EINVAL);
+    }
+    if (pos < 0) return AVERROR(EINVAL);
+    r->pos = pos;  // the next read moves the window
+    return pos;
+}
+
+static void ra_close(void *opaque)
+{
+    Readahead *r = (Readahead*)opaque;
+    {
+        std::unique_lock<std::mutex> lk(r->lock);
+        r->quit = true;
+        r->todo.notify_all();
+#ifdef HAVE_LIBURING
+        /* The kernel may still be writing into the buffers */
+        if (r->uring) {
+            for (int i = 0; i < r->nblocks; ++i)
+                while (r->blocks[i].state == RA_PENDING) ra_wait_any(r, lk);
+            io_uring_queue_exit(&r->ring);
+        }
+#endif
+    }
+    for (std::thread &t : r->workers) t.join();
+    printf("Readahead: %.1f MB read, %.2f s waiting on I/O\n",
+           r->bytes / 1048576.0, r->wait_us / 1e6);
+    if (r->dontneed) posix_fadvise(r->fd, 0, 0, POSIX_FADV_DONTNEED);
+    for (int i = 0; i < r->nblocks; ++i) free(r->blocks[i].buf);
+    free(r->blocks);
+    if (r->fd >= 0) close(r->fd);
+    delete r;
+}
+
+static void *ra_open(const char *path)
+{
+    Readahead *r = new Readahead();
+    r->fd = -1;
+#ifdef O_DIRECT
+    /* Blocks are aligned in memory, offset and length, as O_DIRECT needs.
+     * Filesystems without it (tmpfs, some FUSE) get DONTNEED instead. */
+    if (readahead_direct) {
+        r->fd = open(path, O_RDONLY | O_DIRECT);
+        r->direct = r->fd >= 0;
+    }
+#endif
+    if (r->fd < 0) {
+        r->fd = open(path, O_RDONLY);
+        r->dontneed = readahead_direct;
+    }
+    struct stat st;
+    if (r->fd < 0 || fstat(r->fd, &st) < 0) { ra_close(r); return NULL; }
+    r->size = st.st_size;
+    if (!r->direct) posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    r->nblocks = readahead_blocks;
+    r->blocks = (RaBlock*)calloc(r->nblocks, sizeof(RaBlock));
+    for (int i = 0; i < r->nblocks; ++i)
+        if (posix_memalign((void**)&r->blocks[i].buf, RA_ALIGN, RA_BLOCK_SIZE) != 0) {
+            ra_close(r);
+            return NULL;
+        }
+
+#ifdef HAVE_LIBURING
+    r->uring = io_uring_queue_init(r->nblocks, &r->ring, 0) == 0;
+    if (!r->uring)
+#endif
+        for (int i = 0; i < RA_WORKERS; ++i)
+            r->workers.emplace_back(ra_worker, r);
+
+    r->rate_us = av_gettime_relative();
+    printf("Readahead %s: %d MB window via %s%s\n", path, r->nblocks * (RA_BLOCK_SIZE >> 20),
+           r->workers.empty() ? "io_uring" : "thread pool",
+           r->direct ? ", O_DIRECT" : r->dontneed ? ", dropping consumed pages" : "");
+    return r;
+}
+
+static double resident_mb(void)
+{
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0.0;
+    if (fscanf(f, "%*s %ld", &pages) != 1) pages = 0;
+    fclose(f);
+    return pages * (double)sysconf(_SC_PAGESIZE) / 1048576.0;
+}
+
+static void ra_report(void *opaque)
+{
+    Readahead *r = (Readahead*)opaque;
+    int64_t now = av_gettime_relative();
+    if (now - r->rate_us >= 1000000) {
+        r->rate = (r->bytes - r->rate_bytes) * 1e6 / (now - r->rate_us);
+        r->rate_bytes = r->bytes;
+        r->rate_us = now;
+    }
+    ImGui::Text("Readahead (%s): %.1f MB/s, %.1f MB total",
+                r->workers.empty() ? "io_uring" : "threads", r->rate / 1048576.0, r->bytes / 1048576.0);
+    ImGui::Text("Waiting on I/O: %.1f ms", r->wait_us / 1000.0);
+    if (r->direct || r->dontneed)
+        ImGui::Text("%s, RSS %.0f MB", r->direct ? "O_DIRECT" : "DONTNEED", resident_mb());
+}
+
+static const IoBackend readahead_io = { "readahead", ra_open, NULL, ra_read, ra_seek, ra_close, ra_report };
+
+/* Put a custom AVIOContext on top of the selected backend under *fmt.
+ * share is the opaque of another reader of the same file, if any. */
+static int open_custom_io(const char *path, void *share, AVFormatContext **fmt,
+                          AVIOContext **pb, void **opaque)
+{
+    *opaque = share && io_backend->dup ? io_backend->dup(share) : io_backend->open(path);
+    if (!*opaque) return -1;
+    uint8_t *buf = (uint8_t*)av_malloc(IO_BUFFER_SIZE);
+    *pb = avio_alloc_context(buf, IO_BUFFER_SIZE, 0, *opaque,
+                             io_backend->read, NULL, io_backend->seek);
+    if (!*pb) { av_free(buf); return -1; }
+    *fmt = avformat_alloc_context();
+    (*fmt)->pb = *pb;
+    return 0;
+}
+
+static void close_custom_io(const IoBackend *io, AVIOContext **pb, void **opaque)
+{
+    if (*pb) av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+    if (io && *opaque) io->close(*opaque);
+    *opaque = NULL;
+}
 
 /* -------------------------------------------------------------
  *  Hardware decoding
@@ -115,9 +847,14 @@ static int init_hw_decoder(AVCodecContext *ctx)
         if (!cfg) break;
         if (cfg->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
             cfg->device_type != AV_HWDEVICE_TYPE_NONE) {
-            hw_type = cfg->device_type;
-            if (av_hwdevice_ctx_create(&hw_device_ctx, hw_type, NULL, NULL, 0) < 0)
-                continue;
+            /* One device is shared by every clip of a playlist */
+            if (hw_device_ctx) {
+                if (cfg->device_type != hw_type) continue;
+            } else {
+                if (av_hwdevice_ctx_create(&hw_device_ctx, cfg->device_type, NULL, NULL, 0) < 0)
+                    continue;
+                hw_type = cfg->device_type;
+            }
             ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
             printf("Using HW decoder: %s\n", av_hwdevice_get_type_name(hw_type));
             return 0;
@@ -129,6 +866,177 @@ static int init_hw_decoder(AVCodecContext *ctx)
 /* -------------------------------------------------------------
  *  OpenGL setup
  * ------------------------------------------------------------- */
+/* x, y, u, v, intensity per vertex. VAOs are not shared between
+ * contexts, so every output builds its own in its own context. */
+static void make_mesh(const float *verts, int nverts, const unsigned int *idx, int nidx,
+                      GLuint *vao, GLuint *vbo, GLuint *ebo)
+{
+    glGenVertexArrays(1, vao);
+    glGenBuffers(1, vbo);
+    glGenBuffers(1, ebo);
+    glBindVertexArray(*vao);
+    glBindBuffer(GL_ARRAY_BUFFER, *vbo);
+    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)nverts * 5 * sizeof(float), verts, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (GLsizeiptr)nidx * sizeof(unsigned int), idx, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, 0, 5*sizeof(float), 0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, 0, 5*sizeof(float), (void*)(2*sizeof(float)));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(2, 1, GL_FLOAT, 0, 5*sizeof(float), (void*)(4*sizeof(float)));
+    glEnableVertexAttribArray(2);
+}
+
+/* -------------------------------------------------------------
+ *  Texture tiling: a plane larger than the GPU's texture limit is cut
+ *  into tiles, the layers of one array texture
+ * ------------------------------------------------------------- */
+#define UPLOAD_THREADS 4                // work pool plus the calling thread
+
+typedef struct PlaneTiles {
+    int w, h;                           // plane size
+    int core_w, core_h, apron, layers;  // tile layout
+    GLenum ifmt;
+    GLuint pbo;                         // staging for tiled uploads
+} PlaneTiles;
+
+static GLint max_texture = 0;           // GL_MAX_TEXTURE_SIZE, or lower with --max-texture
+
+/* Persistent threads for the data-parallel parts of an upload: copies
+ * into a tiled plane's PBO, Hap chunk expansion. Started on first use.
+ * The caller works on its own batch too, so batches from several threads
+ * (render, upload, mosaic tiles) can be in flight at once. */
+typedef struct WorkBatch {
+    const std::function<void(int)> *fn;
+    int n, next, done;                  // items, next to hand out, finished
+} WorkBatch;
+
+static std::vector<std::thread> work_threads;
+static std::deque<WorkBatch*> work_queue;      // batches with items left, under work_lock
+static std::mutex work_lock;
+static std::condition_variable work_todo, work_finished;
+static bool work_quit = false;
+
+static void work_item(WorkBatch *b, std::unique_lock<std::mutex> &lk)
+{
+    int i = b->next++;
+    if (b->next == b->n) work_queue.erase(std::find(work_queue.begin(), work_queue.end(), b));
+    lk.unlock();
+    (*b->fn)(i);
+    lk.lock();
+    if (++b->done == b->n) work_finished.notify_all();
+}
+
+static void work_main(void)
+{
+    std::unique_lock<std::mutex> lk(work_lock);
+    for (;;) {
+        work_todo.wait(lk, [] { return work_quit || !work_queue.empty(); });
+        if (work_quit) return;
+        work_item(work_queue.front(), lk);
+    }
+}
+
+/* fn(0) .. fn(n - 1), spread over the pool, back when all have run */
+static void parallel_for(int n, const std::function<void(int)> &fn)
+{
+    if (n <= 1) {
+        if (n == 1) fn(0);
+        return;
+    }
+    WorkBatch b = { &fn, n, 0, 0 };
+    std::unique_lock<std::mutex> lk(work_lock);
+    while ((int)work_threads.size() < UPLOAD_THREADS - 1) work_threads.emplace_back(work_main);
+    work_queue.push_back(&b);
+    work_todo.notify_all();
+    while (b.next < b.n) work_item(&b, lk);
+    work_finished.wait(lk, [&b] { return b.done == b.n; });
+}
+
+static void stop_work_pool(void)
+{
+    {
+        std::lock_guard<std::mutex> lk(work_lock);
+        work_quit = true;
+    }
+    work_todo.notify_all();
+    for (std::thread &t : work_threads) t.join();
+    work_threads.clear();
+    work_quit = false;
+}
+
+/* Upload one plane to the array texture bound on the active unit. Small
+ * planes are one layer, straight from memory. Tiled planes are staged in
+ * a PBO, filled by the work pool, and every tile is then an independent
+ * asynchronous transfer out of it. */
+static void upload_plane(PlaneTiles *t, const uint8_t *data, int linesize, int w, int h, int comps, int bpc)
+{
+    GLenum ifmt = comps == 1 ? (bpc == 2 ? GL_R16 : GL_R8) : (bpc == 2 ? GL_RG16 : GL_RG8);
+    GLenum fmt = comps == 1 ? GL_RED : GL_RG;
+    GLenum type = bpc == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+    int apron = w > max_texture || h > max_texture ? 1 : 0;
+    int core_w = w + 2 * apron <= max_texture ? w : max_texture - 2 * apron;
+    int core_h = h + 2 * apron <= max_texture ? h : max_texture - 2 * apron;
+    int nx = (w + core_w - 1) / core_w, ny = (h + core_h - 1) / core_h;
+
+    if (t->w != w || t->h != h || t->ifmt != ifmt || t->core_w != core_w || t->core_h != core_h) {
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, ifmt, core_w + 2 * apron, core_h + 2 * apron, nx * ny, 0,
+                     fmt, type, NULL);
+        t->w = w; t->h = h; t->ifmt = ifmt;
+        t->core_w = core_w; t->core_h = core_h; t->apron = apron; t->layers = nx * ny;
+        if (apron) printf("%dx%d plane tiled %dx%d (texture limit %d)\n", w, h, nx, ny, max_texture);
+    }
+
+    bool pbo = false;                   // rows come from t->pbo, offsets instead of pointers
+    if (apron) {
+        size_t size = (size_t)linesize * h;
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, t->pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);  // orphan
+        uint8_t *dst = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                                                  GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (dst) {
+            size_t chunk = (h + UPLOAD_THREADS - 1) / UPLOAD_THREADS * (size_t)linesize;
+            parallel_for((int)((size + chunk - 1) / chunk), [&](int i) {
+                size_t off = i * chunk;
+                memcpy(dst + off, data + off, off + chunk < size ? chunk : size - off);
+            });
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            pbo = true;
+        } else {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, bpc);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, linesize / (comps * bpc));
+    for (int j = 0; j < ny; ++j)
+        for (int i = 0; i < nx; ++i) {
+            /* Core plus apron, cut to the plane; the shader never samples
+             * what is left out at the plane's own edges */
+            int x0 = i * core_w - apron, y0 = j * core_h - apron;
+            int sx = x0 > 0 ? x0 : 0, sy = y0 > 0 ? y0 : 0;
+            int ex = x0 + core_w + 2 * apron, ey = y0 + core_h + 2 * apron;
+            if (ex > w) ex = w;
+            if (ey > h) ey = h;
+            size_t off = (size_t)sy * linesize + (size_t)sx * comps * bpc;
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, sx - x0, sy - y0, j * nx + i, ex - sx, ey - sy, 1,
+                            fmt, type, pbo ? (const void*)(uintptr_t)off : data + off);
+        }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    if (pbo) glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+/* The shader's view of a plane's layout, set with the frame it holds */
+static void plane_uniforms(const PlaneTiles *t, GLint loc_tiles, GLint loc_apron)
+{
+    glUniform4f(loc_tiles, (float)t->w, (float)t->h, (float)t->core_w, (float)t->core_h);
+    glUniform1f(loc_apron, (float)t->apron);
+}
+
+static void init_ring(void);
+static void free_ring(void);
+
 static void init_gl(void)
 {
     glewInit();
@@ -144,204 +1052,2687 @@ static void init_gl(void)
     glDeleteShader(vs); glDeleteShader(fs);
 
     locY = glGetUniformLocation(prog, "y");
-    locU = glGetUniformLocation(prog, "u");
-    locV = glGetUniformLocation(prog, "v");
+    locUV = glGetUniformLocation(prog, "uv");
+    locYTiles = glGetUniformLocation(prog, "y_tiles");
+    locUVTiles = glGetUniformLocation(prog, "uv_tiles");
+    locYApron = glGetUniformLocation(prog, "y_apron");
+    locUVApron = glGetUniformLocation(prog, "uv_apron");
+    locYuvMat = glGetUniformLocation(prog, "yuv_mat");
+    locYuvOff = glGetUniformLocation(prog, "yuv_off");
+    locTransfer = glGetUniformLocation(prog, "transfer");
+    locTonemap = glGetUniformLocation(prog, "tonemap");
+    locGamut = glGetUniformLocation(prog, "gamut");
+    locSrcPeak = glGetUniformLocation(prog, "src_peak");
+    locSdrWhite = glGetUniformLocation(prog, "sdr_white");
+    locBlend = glGetUniformLocation(prog, "blend");
+    locViewport = glGetUniformLocation(prog, "viewport");
+    locGamma = glGetUniformLocation(prog, "gamma");
+    locBlack = glGetUniformLocation(prog, "black");
+    locHap = glGetUniformLocation(prog, "hap");
+    locHapScale = glGetUniformLocation(prog, "hap_scale");
 
-    float verts[] = { -1,1,0,1, -1,-1,0,0, 1,1,1,1, 1,-1,1,0 };
+    float verts[] = { -1,1,0,1,1, -1,-1,0,0,1, 1,1,1,1,1, 1,-1,1,0,1 };
     unsigned int idx[] = {0,1,2, 1,3,2};
-    glGenVertexArrays(1, &vao);
-    glGenBuffers(1, &vbo);
-    glGenBuffers(1, &ebo);
-    glBindVertexArray(vao);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(idx), idx, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 2, GL_FLOAT, 0, 4*sizeof(float), 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 2, GL_FLOAT, 0, 4*sizeof(float), (void*)(2*sizeof(float)));
-    glEnableVertexAttribArray(1);
+    make_mesh(verts, 4, idx, 6, &vao, &vbo, &ebo);
 
-    glGenTextures(1, &texY); glGenTextures(1, &texU); glGenTextures(1, &texV);
-    for (int i = 0; i < 3; ++i) {
-        GLuint t = (i==0)?texY:(i==1)?texU:texV;
-        glBindTexture(GL_TEXTURE_2D, t);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    }
+    GLint limit;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &limit);
+    if (!max_texture || max_texture > limit) max_texture = limit;
+
+    init_ring();
 
     glUseProgram(prog);
-    glUniform1i(locY, 0); glUniform1i(locU, 1); glUniform1i(locV, 2);
+    glUniform1i(locY, 0); glUniform1i(locUV, 1);
+    glUniform1i(glGetUniformLocation(prog, "mask"), 2);
+    glUniform1i(glGetUniformLocation(prog, "hap_tex"), 3);
+}
+
+static void free_gl(void)
+{
+    stop_work_pool();
+    free_ring();
+    glDeleteVertexArrays(1, &vao); glDeleteBuffers(1, &vbo); glDeleteBuffers(1, &ebo);
+    glDeleteProgram(prog);
 }
 
 /* -------------------------------------------------------------
  *  Upload NV12 frame (from software or hardware)
  * ------------------------------------------------------------- */
-static void upload_nv12(AVFrame *f, int w, int h)
+/* Chroma stays interleaved: one GL_RG texture samples Cb and Cr together.
+ * P010 (more than 8 bits) goes up as 16-bit textures. */
+static void upload_nv12(AVFrame *f, int w, int h, GLuint y, GLuint uv, PlaneTiles pt[2])
 {
-    glActiveTexture(GL_TEXTURE0); glBindTexture(GL_TEXTURE_2D, texY);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, w, h, 0, GL_RED, GL_UNSIGNED_BYTE, f->data[0]);
-
-    glActiveTexture(GL_TEXTURE1); glBindTexture(GL_TEXTURE_2D, texU);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, w/2, h/2, 0, GL_RED, GL_UNSIGNED_BYTE, f->data[1]);
-
-    glActiveTexture(GL_TEXTURE2); glBindTexture(GL_TEXTURE_2D, texV);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, w/2, h/2, 0, GL_RED, GL_UNSIGNED_BYTE, f->data[1]+1);
+    int bpc = f->format == AV_PIX_FMT_P010LE ? 2 : 1;
+    glActiveTexture(GL_TEXTURE0); glBindTexture(GL_TEXTURE_2D_ARRAY, y);
+    upload_plane(&pt[0], f->data[0], f->linesize[0], w, h, 1, bpc);
+    glActiveTexture(GL_TEXTURE1); glBindTexture(GL_TEXTURE_2D_ARRAY, uv);
+    upload_plane(&pt[1], f->data[1], f->linesize[1], (w + 1) / 2, (h + 1) / 2, 2, bpc);
 }
 
 /* -------------------------------------------------------------
- *  Render frame
+ *  Colour: YUV->RGB matrix and offsets from the frame's tags, set as
+ *  uniforms only when the tags change, i.e. once per stream
  * ------------------------------------------------------------- */
-static void render_frame(AVFrame *f, int w, int h)
+enum { TONEMAP_CLIP, TONEMAP_REINHARD, TONEMAP_HABLE, TONEMAP_BT2390, TONEMAPS };
+static const char *tonemap_name[TONEMAPS] = { "clip", "reinhard", "hable", "bt2390" };
+static int tonemap = TONEMAP_BT2390;
+static float sdr_white = 203.0f;        // nits that become SDR 100% (BT.2408)
+
+typedef struct ColorTags {
+    int space, range, primaries, trc, depth, peak, hd;
+} ColorTags;
+
+static ColorTags color_tags = { -1, -1, -1, -1, -1, -1, -1 };
+
+/* Content peak in nits: MaxCLL, else the mastering display, else 1000 */
+static int hdr_peak(const AVFrame *f)
 {
-    glClear(GL_COLOR_BUFFER_BIT);
-    upload_nv12(f, w, h);
-    glBindVertexArray(vao);
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    const AVFrameSideData *sd = av_frame_get_side_data(f, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL);
+    if (sd && ((const AVContentLightMetadata*)sd->data)->MaxCLL)
+        return ((const AVContentLightMetadata*)sd->data)->MaxCLL;
+    sd = av_frame_get_side_data(f, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA);
+    if (sd && ((const AVMasteringDisplayMetadata*)sd->data)->has_luminance)
+        return (int)av_q2d(((const AVMasteringDisplayMetadata*)sd->data)->max_luminance);
+    return 1000;
 }
 
-/* -------------------------------------------------------------
- *  Audio callback (SDL)
- * ------------------------------------------------------------- */
-static void audio_callback(void *userdata, Uint8 *stream, int len)
+static int color_transfer(int trc)
 {
-    if (audio_buf_index >= audio_buf_size) {
-        SDL_memset(stream, 0, len);
-        return;
+    return trc == AVCOL_TRC_SMPTE2084 ? 1 : trc == AVCOL_TRC_ARIB_STD_B67 ? 2 : 0;
+}
+
+/* Taken at upload, applied when the frame is shown */
+static ColorTags frame_tags(const AVFrame *f)
+{
+    ColorTags t = { f->colorspace, f->color_range, f->color_primaries, f->color_trc,
+                    f->format == AV_PIX_FMT_P010LE ? 10 : 8,
+                    color_transfer(f->color_trc) ? hdr_peak(f) : 0, f->height >= 720 };
+    return t;
+}
+
+static void set_color_uniforms(const ColorTags *tags)
+{
+    if (!memcmp(tags, &color_tags, sizeof(*tags))) return;
+    ColorTags t = color_tags = *tags;
+    int transfer = color_transfer(t.trc);
+
+    /* Untagged: HD and up is BT.709, SD is BT.601 */
+    int space = t.space;
+    if (space == AVCOL_SPC_UNSPECIFIED || space == AVCOL_SPC_RGB)
+        space = t.hd ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+    double kr, kb;
+    switch (space) {
+    case AVCOL_SPC_BT709:      kr = 0.2126; kb = 0.0722; break;
+    case AVCOL_SPC_FCC:        kr = 0.30;   kb = 0.11;   break;
+    case AVCOL_SPC_SMPTE240M:  kr = 0.212;  kb = 0.087;  break;
+    case AVCOL_SPC_BT2020_NCL:
+    case AVCOL_SPC_BT2020_CL:  kr = 0.2627; kb = 0.0593; break;  // CL approximated as NCL
+    default:                   kr = 0.299;  kb = 0.114;  break;  // BT.601
     }
-    int copy = audio_buf_size - audio_buf_index;
-    if (copy > len) copy = len;
-    SDL_memcpy(stream, audio_buf + audio_buf_index, copy);
-    audio_buf_index += copy;
-    if (copy < len)
-        SDL_memset(stream + copy, 0, len - copy);
+    double kg = 1.0 - kr - kb;
+
+    /* Limited range is Y 16-235, C 16-240 at 8 bits, scaled up for deeper
+     * video. unit: one code value as the texture samples it (P010 keeps
+     * its 10 bits at the top of 16). */
+    bool full = t.range == AVCOL_RANGE_JPEG;
+    double scale = 1 << (t.depth - 8);
+    double unit = t.depth > 8 ? (1 << (16 - t.depth)) / 65535.0 : 1.0 / 255.0;
+    double ys = 1.0 / ((full ? (1 << t.depth) - 1 : 219 * scale) * unit);
+    double cs = 1.0 / ((full ? (1 << t.depth) - 1 : 224 * scale) * unit);
+    float off[3] = { (float)(full ? 0.0 : 16 * scale * unit),
+                     (float)(128 * scale * unit), (float)(128 * scale * unit) };
+    float m[9] = {                      // column-major: Y, Cb, Cr columns
+        (float)ys, (float)ys, (float)ys,
+        0.0f, (float)(-cs * 2.0 * kb * (1.0 - kb) / kg), (float)(cs * 2.0 * (1.0 - kb)),
+        (float)(cs * 2.0 * (1.0 - kr)), (float)(-cs * 2.0 * kr * (1.0 - kr) / kg), 0.0f,
+    };
+    glUseProgram(prog);
+    glUniformMatrix3fv(locYuvMat, 1, GL_FALSE, m);
+    glUniform3fv(locYuvOff, 1, off);
+    glUniform1i(locTransfer, transfer);
+    glUniform1i(locTonemap, tonemap);
+    glUniform1i(locGamut, t.primaries == AVCOL_PRI_BT2020);
+    glUniform1f(locSrcPeak, (float)(t.peak > sdr_white ? t.peak : sdr_white));
+    glUniform1f(locSdrWhite, sdr_white);
+    printf("Colour: %s matrix, %s range, %s primaries, %d bits\n", av_color_space_name((enum AVColorSpace)space),
+           full ? "full" : "limited", av_color_primaries_name((enum AVColorPrimaries)t.primaries), t.depth);
+    if (transfer)
+        printf("HDR: %s, peak %d nits, tone-mapped with %s\n", transfer == 1 ? "PQ" : "HLG",
+               t.peak, tonemap_name[tonemap]);
 }
 
 /* -------------------------------------------------------------
- *  Open file + streams
+ *  Texture ring: frames are uploaded as soon as they are decoded, into
+ *  one of several texture sets tagged with their pts, while an earlier
+ *  set is on screen. The presenter picks the set due at each vsync, so
+ *  the driver never has to wait for a draw before it can overwrite.
  * ------------------------------------------------------------- */
-static int open_file(const char *path)
-{
-    if (avformat_open_input(&fmt, path, NULL, NULL) < 0) return -1;
-    if (avformat_find_stream_info(fmt, NULL) < 0) return -1;
+#define TEXTURE_SETS 3
 
-    for (unsigned i = 0; i < fmt->nb_streams; ++i) {
-        AVStream *st = fmt->streams[i];
-        if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && vidx < 0) vidx = i;
-        if (st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && aidx < 0) aidx = i;
-    }
-    if (vidx < 0) return -1;
+enum { SET_FREE, SET_UPLOADING, SET_QUEUED, SET_SHOWN };
 
-    duration = fmt->duration * 1e-6;  // seconds
+typedef struct TextureSet {
+    GLuint y, uv;                       // planes, GL_TEXTURE_2D_ARRAY
+    PlaneTiles tiles[2];                // Y, CbCr
+    GLuint hap;                         // Hap blocks, GL_TEXTURE_2D
+    int hap_type, hap_w, hap_h;         // as allocated in hap
+    int mode;                           // shader mode of the frame held: 0 planes, else Hap
+    float hap_scale[2];
+    ColorTags tags;
+    double t;                           // presentation time, seconds
+    int64_t ts;                         // stream timestamp
+    uint64_t order;                     // upload order
+    GLsync fence;                       // upload thread: signalled when the upload is done
+    int state;                          // SET_*, under ring_lock
+} TextureSet;
 
-    /* --- Video --- */
-    AVCodecParameters *vpar = fmt->streams[vidx]->codecpar;
-    const AVCodec *vcodec = avcodec_find_decoder(vpar->codec_id);
-    vdec = avcodec_alloc_context3(vcodec);
-    avcodec_parameters_to_context(vdec, vpar);
-    if (init_hw_decoder(vdec) < 0)
-        printf("No HW decoder, using software\n");
-    if (avcodec_open2(vdec, vcodec, NULL) < 0) return -1;
+static TextureSet sets[TEXTURE_SETS];
+static TextureSet *shown_set = NULL;    // on screen, NULL before the first frame
+static uint64_t set_order = 0;
+static std::mutex ring_lock;
+static std::condition_variable ring_uploaded;
 
-    /* --- Audio --- */
-    if (aidx >= 0) {
-        AVCodecParameters *apar = fmt->streams[aidx]->codecpar;
-        const AVCodec *acodec = avcodec_find_decoder(apar->codec_id);
-        adec = avcodec_alloc_context3(acodec);
-        avcodec_parameters_to_context(adec, apar);
-        if (avcodec_open2(adec, acodec, NULL) < 0)
-            adec = NULL;
-    }
+static void texture_params(GLenum target)
+{
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
 
-    vframe = av_frame_alloc();
-    if (aidx >= 0) aframe = av_frame_alloc();
+static void init_ring(void)
+{
+    for (TextureSet &s : sets) {
+        memset(&s, 0, sizeof(s));
+        glGenTextures(1, &s.y); glGenTextures(1, &s.uv); glGenTextures(1, &s.hap);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, s.y);  texture_params(GL_TEXTURE_2D_ARRAY);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, s.uv); texture_params(GL_TEXTURE_2D_ARRAY);
+        glBindTexture(GL_TEXTURE_2D, s.hap);      texture_params(GL_TEXTURE_2D);
+        glGenBuffers(1, &s.tiles[0].pbo); glGenBuffers(1, &s.tiles[1].pbo);
+    }
+    shown_set = NULL;
+}
 
-    sws = sws_getContext(vdec->width, vdec->height, vdec->pix_fmt,
-                         vdec->width, vdec->height, AV_PIX_FMT_NV12,
-                         SWS_BILINEAR, NULL, NULL, NULL);
-    return 0;
+static void free_ring(void)
+{
+    for (TextureSet &s : sets) {
+        if (s.fence) glDeleteSync(s.fence);
+        glDeleteTextures(1, &s.y); glDeleteTextures(1, &s.uv); glDeleteTextures(1, &s.hap);
+        glDeleteBuffers(1, &s.tiles[0].pbo); glDeleteBuffers(1, &s.tiles[1].pbo);
+    }
+    shown_set = NULL;
 }
 
 /* -------------------------------------------------------------
- *  Main loop
+ *  Hap: packets hold DXT / BC7 texture blocks behind an optional Snappy
+ *  stage. Only that is undone on the CPU; the blocks go to the GPU as a
+ *  compressed texture, with no pixel decode and no sws_scale.
  * ------------------------------------------------------------- */
-static void run(GLFWwindow *win, const char *path)
-{
-    if (open_file(path) < 0) { fprintf(stderr, "Failed to open file\n"); return; }
+/* Texture formats, the low nibble of a section type... */
+enum { HAP_ALPHA_RGTC1 = 0x1, HAP_RGB_DXT1 = 0xB, HAP_RGBA_BC7 = 0xC, HAP_MULTIPLE = 0xD,
+       HAP_RGBA_DXT5 = 0xE, HAP_YCOCG_DXT5 = 0xF };
+/* ... and second-stage compressors, the high nibble */
+enum { HAP_NONE = 0xA, HAP_SNAPPY = 0xB, HAP_CHUNKED = 0xC };
 
-    /* --- Audio init --- */
-    if (aidx >= 0 && adec) {
-        SDL_AudioSpec want = {0}, have;
-        want.freq = adec->sample_rate;
-        want.format = AUDIO_S16SYS;
-        want.channels = adec->ch_layout.nb_channels;
-        want.samples = 1024;
-        want.callback = audio_callback;
-        audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
-        if (audio_dev) SDL_PauseAudioDevice(audio_dev, 0);
-    }
+typedef struct HapChunk {
+    const uint8_t *src;
+    size_t size, out_size;
+    uint8_t *dst;
+    int comp;
+} HapChunk;
 
-    /* --- Temp NV12 frame --- */
-    AVFrame *nv12 = av_frame_alloc();
-    uint8_t *buf = NULL;
-    int size = av_image_get_buffer_size(AV_PIX_FMT_NV12, vdec->width, vdec->height, 1);
-    buf = (uint8_t*)av_malloc(size);
-    av_image_fill_arrays(nv12->data, nv12->linesize, buf, AV_PIX_FMT_NV12, vdec->width, vdec->height, 1);
+static int hap_mode = 0;                // shader: 0 YUV planes, 1 RGB(A), 2 YCoCg, 3 grey
+static int hap_shown = 0;               // texture type last reported, render thread only
 
-    double start = glfwGetTime();
-    double last_video = 0.0;
+static const char *hap_name(int tex)
+{
+    switch (tex) {
+    case HAP_RGB_DXT1:   return "Hap (DXT1)";
+    case HAP_RGBA_DXT5:  return "Hap Alpha (DXT5)";
+    case HAP_YCOCG_DXT5: return "Hap Q (YCoCg DXT5)";
+    case HAP_RGBA_BC7:   return "Hap R (BC7)";
+    default:             return "Hap Alpha-only (RGTC1)";
+    }
+}
 
-    while (!glfwWindowShouldClose(win)) {
-        double now = glfwGetTime();
-        double video_time = now - start;
+/* Passthrough needs Snappy, the GPU's block formats and a frame that fits
+ * one texture; otherwise FFmpeg's Hap decoder expands the blocks on the
+ * CPU. Mosaic tiles always take that path, they convert into one frame. */
+static bool hap_passthrough(const AVCodecParameters *par)
+{
+#ifdef HAVE_SNAPPY
+    if (par->codec_id != AV_CODEC_ID_HAP || ntiles) return false;
+    if (par->width > max_texture || par->height > max_texture) return false;
+    if (par->codec_tag == MKTAG('H','a','p','7')) return GLEW_ARB_texture_compression_bptc;
+    if (par->codec_tag == MKTAG('H','a','p','A')) return true;      // RGTC is core
+    return GLEW_EXT_texture_compression_s3tc;
+#else
+    return false;
+#endif
+}
+
+static bool hap_frame(const AVFrame *f)
+{
+    return f->format == AV_PIX_FMT_NONE && f->opaque;  // opaque: the texture format
+}
+
+static uint32_t hap_rl(const uint8_t *p, int n)     // little-endian, n bytes
+{
+    uint32_t v = 0;
+    for (int i = n - 1; i >= 0; --i) v = v << 8 | p[i];
+    return v;
+}
+
+/* Section header: 24-bit size and type byte, or a zero size and then a
+ * 32-bit one. Returns the header length, 0 if the section overruns n. */
+static size_t hap_section(const uint8_t *p, size_t n, size_t *size, int *type)
+{
+    if (n < 4) return 0;
+    size_t hdr = 4;
+    *size = hap_rl(p, 3);
+    *type = p[3];
+    if (!*size) {
+        if (n < 8) return 0;
+        *size = hap_rl(p + 4, 4);
+        hdr = 8;
+    }
+    return *size <= n - hdr ? hdr : 0;
+}
+
+/* A plain or Snappy section is one chunk. A chunked one starts with decode
+ * instructions: compressor, size and (optional) offset per chunk. */
+static bool hap_chunks(const uint8_t *d, size_t n, int comp, std::vector<HapChunk> &out)
+{
+    if (comp != HAP_CHUNKED) {
+        out.push_back({ d, n, 0, NULL, comp });
+        return true;
+    }
+    size_t size, count = 0, nsizes = 0, noffsets = 0;
+    int type;
+    size_t hdr = hap_section(d, n, &size, &type);
+    if (!hdr || type != 0x01) return false;
+    const uint8_t *ins = d + hdr, *comps = NULL, *sizes = NULL, *offsets = NULL;
+    for (size_t pos = 0; pos < size; ) {
+        size_t len;
+        size_t h = hap_section(ins + pos, size - pos, &len, &type);
+        if (!h) return false;
+        if (type == 0x02) { comps = ins + pos + h; count = len; }
+        else if (type == 0x03) { sizes = ins + pos + h; nsizes = len / 4; }
+        else if (type == 0x04) { offsets = ins + pos + h; noffsets = len / 4; }
+        pos += h + len;
+    }
+    if (!count || nsizes < count || (offsets && noffsets < count)) return false;
+
+    const uint8_t *data = ins + size;
+    size_t avail = n - hdr - size, at = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size_t len = hap_rl(sizes + 4 * i, 4);
+        if (offsets) at = hap_rl(offsets + 4 * i, 4);
+        if (at > avail || len > avail - at) return false;
+        out.push_back({ data + at, len, 0, NULL, comps[i] });
+        at += len;
+    }
+    return true;
+}
+
+static bool hap_measure(HapChunk *k)
+{
+    if (k->comp == HAP_NONE) {
+        k->out_size = k->size;
+        return true;
+    }
+#ifdef HAVE_SNAPPY
+    return k->comp == HAP_SNAPPY &&
+           snappy_uncompressed_length((const char*)k->src, k->size, &k->out_size) == SNAPPY_OK;
+#else
+    return false;
+#endif
+}
+
+static bool hap_expand(const HapChunk *k)
+{
+    if (k->comp == HAP_NONE) {
+        memcpy(k->dst, k->src, k->size);
+        return true;
+    }
+#ifdef HAVE_SNAPPY
+    size_t n = k->out_size;
+    return snappy_uncompress((const char*)k->src, k->size, (char*)k->dst, &n) == SNAPPY_OK &&
+           n == k->out_size;
+#else
+    return false;
+#endif
+}
+
+/* Unpack one packet into c->vframe: the blocks in data[0] (from a pool,
+ * one row of blocks per linesize), format NONE and the texture format in
+ * opaque. Hap Q Alpha's second (alpha) texture is not used. */
+static int hap_unpack(Clip *c, const AVPacket *p)
+{
+    const uint8_t *d = p->data;
+    size_t size;
+    int type;
+    size_t hdr = hap_section(d, p->size, &size, &type);
+    if (hdr && (type & 0x0f) == HAP_MULTIPLE) {
+        d += hdr;
+        hdr = hap_section(d, size, &size, &type);
+    }
+    if (!hdr) return -1;
+    int tex = type & 0x0f;
+    if (tex != HAP_RGB_DXT1 && tex != HAP_RGBA_DXT5 && tex != HAP_YCOCG_DXT5 &&
+        tex != HAP_RGBA_BC7 && tex != HAP_ALPHA_RGTC1) return -1;
+    int block = tex == HAP_RGB_DXT1 || tex == HAP_ALPHA_RGTC1 ? 8 : 16;
+    int w = c->vdec->width, h = c->vdec->height;
+    size_t row = (size_t)(w + 3) / 4 * block, bytes = row * ((h + 3) / 4);
+
+    std::vector<HapChunk> chunks;
+    if (!hap_chunks(d + hdr, size, type >> 4, chunks)) return -1;
+    size_t at = 0;
+    for (HapChunk &k : chunks) {
+        if (!hap_measure(&k) || k.out_size > bytes - at) return -1;
+        at += k.out_size;
+    }
+    if (at != bytes) return -1;
+
+    if (!c->hap_pool || c->hap_pool_size != bytes) {
+        av_buffer_pool_uninit(&c->hap_pool);        // freed once its frames are
+        c->hap_pool = av_buffer_pool_init(bytes, NULL);
+        c->hap_pool_size = bytes;
+    }
+    AVFrame *f = c->vframe;
+    av_frame_unref(f);
+    if (!c->hap_pool || !(f->buf[0] = av_buffer_pool_get(c->hap_pool))) return -1;
+    f->data[0] = f->buf[0]->data;
+    at = 0;
+    for (HapChunk &k : chunks) {
+        k.dst = f->data[0] + at;
+        at += k.out_size;
+    }
+
+    /* Chunks exist to be expanded in parallel */
+    std::atomic<bool> ok(true);
+    parallel_for((int)chunks.size(), [&](int i) {
+        if (!hap_expand(&chunks[i])) ok = false;
+    });
+    if (!ok) {
+        av_frame_unref(f);
+        return -1;
+    }
+
+    f->linesize[0] = (int)row;
+    f->width = w;
+    f->height = h;
+    f->format = AV_PIX_FMT_NONE;
+    f->opaque = (void*)(intptr_t)tex;
+    f->pts = f->best_effort_timestamp = p->pts != AV_NOPTS_VALUE ? p->pts : p->dts;
+    f->duration = p->duration;
+    f->flags = AV_FRAME_FLAG_KEY;       // every Hap frame stands alone
+    return 0;
+}
+
+/* Switching to Hap drops the YUV and HDR state; set_color_uniforms sets
+ * it again for the next YUV frame. */
+static void set_hap_mode(int mode)
+{
+    if (mode == hap_mode) return;
+    hap_mode = mode;
+    glUseProgram(prog);
+    glUniform1i(locHap, mode);
+    if (!mode) return;
+    glUniform1i(locTransfer, 0);
+    glUniform1i(locGamut, 0);
+    color_tags.space = -1;
+}
+
+/* The texture is padded to whole 4x4 blocks; hap_scale crops it back */
+static void upload_hap(AVFrame *f, TextureSet *s)
+{
+    int tex = (int)(intptr_t)f->opaque;
+    GLenum ifmt = tex == HAP_RGB_DXT1    ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT :
+                  tex == HAP_RGBA_BC7    ? GL_COMPRESSED_RGBA_BPTC_UNORM :
+                  tex == HAP_ALPHA_RGTC1 ? GL_COMPRESSED_RED_RGTC1 : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    int w = (f->width + 3) & ~3, h = (f->height + 3) & ~3;
+    GLsizei bytes = f->linesize[0] * (h / 4);
+    glActiveTexture(GL_TEXTURE3); glBindTexture(GL_TEXTURE_2D, s->hap);
+    if (tex != s->hap_type || w != s->hap_w || h != s->hap_h) {
+        glCompressedTexImage2D(GL_TEXTURE_2D, 0, ifmt, w, h, 0, bytes, NULL);
+        s->hap_type = tex; s->hap_w = w; s->hap_h = h;
+    }
+    glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, ifmt, bytes, f->data[0]);
+    s->hap_scale[0] = (float)f->width / w;
+    s->hap_scale[1] = (float)f->height / h;
+    s->mode = tex == HAP_YCOCG_DXT5 ? 2 : tex == HAP_ALPHA_RGTC1 ? 3 : 1;
+}
+
+/* -------------------------------------------------------------
+ *  Render frame
+ * ------------------------------------------------------------- */
+/* A free set, reserved for an upload; with none left the oldest queued
+ * frame gives way */
+static TextureSet *take_set(void)
+{
+    std::lock_guard<std::mutex> lk(ring_lock);
+    TextureSet *take = NULL;
+    for (TextureSet &s : sets) {
+        if (s.state == SET_FREE) { take = &s; break; }
+        if (s.state == SET_QUEUED && (!take || s.order < take->order)) take = &s;
+    }
+    if (take->state == SET_QUEUED) {
+        if (take->fence) glDeleteSync(take->fence);
+        take->fence = 0;
+        drops[DROP_LATE]++;
+    }
+    take->state = SET_UPLOADING;
+    take->order = set_order++;
+    return take;
+}
+
+static bool ring_free(void)
+{
+    std::lock_guard<std::mutex> lk(ring_lock);
+    for (const TextureSet &s : sets)
+        if (s.state == SET_FREE) return true;
+    return false;
+}
+
+static void fill_set(TextureSet *s, AVFrame *f, int w, int h)
+{
+    if (hap_frame(f)) {
+        upload_hap(f, s);
+    } else {
+        upload_nv12(f, w, h, s->y, s->uv, s->tiles);
+        s->mode = 0;
+        s->tags = frame_tags(f);
+    }
+}
+
+static TextureSet *upload_frame(AVFrame *f, int w, int h)
+{
+    TextureSet *s = take_set();
+    fill_set(s, f, w, h);
+    return s;
+}
+
+/* Bind s's textures on units 0, 1 and 3 of the current context */
+static void bind_set(const TextureSet *s)
+{
+    glActiveTexture(GL_TEXTURE0); glBindTexture(GL_TEXTURE_2D_ARRAY, s->y);
+    glActiveTexture(GL_TEXTURE1); glBindTexture(GL_TEXTURE_2D_ARRAY, s->uv);
+    glActiveTexture(GL_TEXTURE3); glBindTexture(GL_TEXTURE_2D, s->hap);
+}
+
+/* s goes on screen; its layout and colour uniforms replace the last set's.
+ * An upload from the other context is waited for on the GPU, not here.
+ * The fence is kept until render_outputs has made every projector's
+ * context wait on it as well. */
+static void show_set(TextureSet *s)
+{
+    {
+        std::lock_guard<std::mutex> lk(ring_lock);
+        if (shown_set && shown_set != s) {
+            if (shown_set->fence) glDeleteSync(shown_set->fence);  // replaced before the outputs drew it
+            shown_set->fence = 0;
+            shown_set->state = SET_FREE;
+        }
+        s->state = SET_SHOWN;
+        shown_set = s;
+    }
+    if (s->fence) glWaitSync(s->fence, 0, GL_TIMEOUT_IGNORED);
+    set_hap_mode(s->mode);
+    if (s->mode && s->hap_type != hap_shown) {
+        printf("%s: %dx%d, blocks uploaded without decoding\n", hap_name(s->hap_type),
+               (int)(s->hap_w * s->hap_scale[0] + 0.5f), (int)(s->hap_h * s->hap_scale[1] + 0.5f));
+        hap_shown = s->hap_type;
+    }
+    glUseProgram(prog);
+    if (s->mode) {
+        glUniform2fv(locHapScale, 1, s->hap_scale);
+    } else {
+        plane_uniforms(&s->tiles[0], locYTiles, locYApron);
+        plane_uniforms(&s->tiles[1], locUVTiles, locUVApron);
+        set_color_uniforms(&s->tags);
+    }
+}
+
+/* -------------------------------------------------------------
+ *  Upload thread (--upload-thread): a hidden window's context, shared
+ *  with the main one, fills the texture sets. Each comes back with a
+ *  fence, so the render thread only draws the warp and the UI.
+ * ------------------------------------------------------------- */
+typedef struct UploadJob {
+    AVFrame *f;                         // a reference, the decoder moves on
+    TextureSet *s;
+} UploadJob;
+
+static bool upload_thread = false;
+static GLFWwindow *upload_win = NULL;   // NULL: uploads run on the render thread
+static std::thread upload_worker;
+static std::deque<UploadJob> upload_jobs;  // under ring_lock
+static bool upload_quit = false;
+static std::atomic<int64_t> upload_us{0}, upload_count{0};
+
+static void upload_main(void)
+{
+    glfwMakeContextCurrent(upload_win);
+    std::unique_lock<std::mutex> lk(ring_lock);
+    for (;;) {
+        ring_uploaded.wait(lk, [] { return upload_quit || !upload_jobs.empty(); });
+        if (upload_jobs.empty()) break;
+        UploadJob j = upload_jobs.front();
+        upload_jobs.pop_front();
+        lk.unlock();
+        int64_t t0 = av_gettime_relative();
+        fill_set(j.s, j.f, j.f->width, j.f->height);
+        j.s->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();                      // the fence must reach the GPU before another context waits on it
+        av_frame_free(&j.f);
+        upload_us += av_gettime_relative() - t0;
+        upload_count++;
+        lk.lock();
+        j.s->state = SET_QUEUED;
+        ring_uploaded.notify_all();
+    }
+    lk.unlock();
+    glfwMakeContextCurrent(NULL);
+}
+
+/* Mosaic frames are rewritten in place by the tile threads, so the mosaic
+ * keeps uploading on the render thread */
+static int start_upload_thread(GLFWwindow *share)
+{
+    if (!upload_thread || ntiles) return 0;
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    upload_win = glfwCreateWindow(16, 16, "upload", NULL, share);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+    if (!upload_win) {
+        fprintf(stderr, "--upload-thread: could not create a shared context\n");
+        return -1;
+    }
+    glfwMakeContextCurrent(share);
+    upload_quit = false;
+    upload_worker = std::thread(upload_main);
+    printf("Uploads on their own thread and shared context\n");
+    return 0;
+}
+
+static void stop_upload_thread(void)
+{
+    if (!upload_win) return;
+    {
+        std::lock_guard<std::mutex> lk(ring_lock);
+        upload_quit = true;
+        ring_uploaded.notify_all();
+    }
+    upload_worker.join();
+    for (UploadJob &j : upload_jobs) av_frame_free(&j.f);
+    upload_jobs.clear();
+    glfwDestroyWindow(upload_win);
+    upload_win = NULL;
+}
+
+static void ring_queue(AVFrame *f, int w, int h, double t, int64_t ts)
+{
+    TextureSet *s = take_set();
+    s->t = t;
+    s->ts = ts;
+    if (upload_win) {
+        AVFrame *ref = av_frame_clone(f);
+        std::lock_guard<std::mutex> lk(ring_lock);
+        if (!ref) { s->state = SET_FREE; return; }
+        upload_jobs.push_back({ ref, s });
+        ring_uploaded.notify_all();
+        return;
+    }
+    fill_set(s, f, w, h);
+    std::lock_guard<std::mutex> lk(ring_lock);
+    s->state = SET_QUEUED;
+}
+
+/* Queued frames are dropped on seeks and transport changes, once the
+ * upload thread has finished with them */
+static void ring_flush(void)
+{
+    std::unique_lock<std::mutex> lk(ring_lock);
+    ring_uploaded.wait(lk, [] {
+        for (const TextureSet &s : sets)
+            if (s.state == SET_UPLOADING) return false;
+        return true;
+    });
+    for (TextureSet &s : sets)
+        if (s.state == SET_QUEUED) {
+            if (s.fence) glDeleteSync(s.fence);
+            s.fence = 0;
+            s.state = SET_FREE;
+        }
+}
+
+/* Show the newest queued set that is due at clock; older ones were never
+ * on screen and count as late. NULL: nothing new is due. */
+static TextureSet *ring_pick(double clock)
+{
+    TextureSet *due = NULL;
+    {
+        std::lock_guard<std::mutex> lk(ring_lock);
+        for (TextureSet &s : sets)
+            if (s.state == SET_QUEUED && s.t <= clock && (!due || s.order > due->order)) due = &s;
+        if (!due) return NULL;
+        for (TextureSet &s : sets)
+            if (s.state == SET_QUEUED && s.order < due->order) {
+                if (s.fence) glDeleteSync(s.fence);
+                s.fence = 0;
+                s.state = SET_FREE;
+                drops[DROP_LATE]++;
+            }
+    }
+    show_set(due);
+    return due;
+}
+
+/* Called every vsync. f is shown at once (paused, stepping); NULL draws
+ * the set already on screen. */
+static void render_frame(AVFrame *f, int w, int h)
+{
+    glClear(GL_COLOR_BUFFER_BIT);
+    if (f) show_set(upload_frame(f, w, h));
+    if (!shown_set) return;
+    bind_set(shown_set);
+    glUseProgram(prog);
+    glUniform1i(locBlend, 0);
+    glBindVertexArray(vao);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+}
+
+/* -------------------------------------------------------------
+ *  Projector outputs: one window per projector, sharing the main
+ *  context's textures and program, each drawing its own warp mesh
+ * ------------------------------------------------------------- */
+#define MAX_OUTPUTS 8
+
+typedef struct Output {
+    int monitor;                        // glfwGetMonitors() index, -1 windowed
+    const char *mesh_path;              // Bourke warp mesh, NULL: plain quad
+    const char *mask_path;              // edge-blend mask image, NULL: none
+    float gamma[3], black[3];           // projector gamma, black-level lift
+    GLFWwindow *win;
+    GLuint vao, vbo, ebo;
+    GLsizei count;
+    GLuint mask;
+} Output;
+
+static Output outputs[MAX_OUTPUTS];
+static int noutputs = 0;
+
+/* Paul Bourke's warp mesh format: a type line (2 = rectangular), "nx ny",
+ * then nx*ny rows of "x y u v i". x spans the aspect ratio of the
+ * projector and is normalised here; vertices with i < 0 are unused. */
+static int load_warp_mesh(Output *o)
+{
+    FILE *f = fopen(o->mesh_path, "r");
+    if (!f) { fprintf(stderr, "Cannot open warp mesh %s\n", o->mesh_path); return -1; }
+    int type, nx, ny;
+    if (fscanf(f, "%d %d %d", &type, &nx, &ny) != 3 || type != 2 || nx < 2 || ny < 2) {
+        fprintf(stderr, "%s: not a rectangular warp mesh\n", o->mesh_path);
+        fclose(f);
+        return -1;
+    }
+    std::vector<float> verts((size_t)nx * ny * 5);
+    float xmax = 1e-6f;
+    for (int n = 0; n < nx * ny; ++n) {
+        float *v = &verts[(size_t)n * 5];
+        if (fscanf(f, "%f %f %f %f %f", &v[0], &v[1], &v[2], &v[3], &v[4]) != 5) {
+            fprintf(stderr, "%s: truncated at node %d\n", o->mesh_path, n);
+            fclose(f);
+            return -1;
+        }
+        if (fabsf(v[0]) > xmax) xmax = fabsf(v[0]);
+    }
+    fclose(f);
+
+    std::vector<unsigned int> idx;
+    for (int n = 0; n < nx * ny; ++n) verts[(size_t)n * 5] /= xmax;
+    for (int j = 0; j + 1 < ny; ++j)
+        for (int i = 0; i + 1 < nx; ++i) {
+            unsigned int a = j * nx + i, b = a + 1, c = a + nx, d = c + 1;
+            if (verts[a*5+4] < 0 || verts[b*5+4] < 0 || verts[c*5+4] < 0 || verts[d*5+4] < 0)
+                continue;
+            unsigned int quad[] = { a, b, c, b, d, c };
+            idx.insert(idx.end(), quad, quad + 6);
+        }
+    make_mesh(verts.data(), nx * ny, idx.data(), (int)idx.size(), &o->vao, &o->vbo, &o->ebo);
+    o->count = (GLsizei)idx.size();
+    printf("Output %d: %s, %dx%d mesh, %d triangles\n", (int)(o - outputs), o->mesh_path,
+           nx, ny, o->count / 3);
+    return 0;
+}
+
+/* EXR decodes to linear light, which the shader takes as already
+ * encoded (far too dark): pictures get the sRGB curve from the decoder */
+static void display_options(const AVCodec *codec, AVDictionary **opts)
+{
+    if (codec && codec->id == AV_CODEC_ID_EXR)
+        av_dict_set_int(opts, "apply_trc", AVCOL_TRC_IEC61966_2_1, 0);
+}
+
+/* Decode the (first) picture of an image file, NULL on failure. display:
+ * a picture to show, not data such as a blend mask, which stays linear. */
+static AVFrame *load_image(const char *path, bool display)
+{
+    AVFormatContext *fmt = NULL;
+    AVCodecContext *dec = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *img = av_frame_alloc();
+    AVDictionary *opts = NULL;
+    const AVCodec *codec;
+    int idx;
+
+    if (avformat_open_input(&fmt, path, NULL, NULL) < 0 ||
+        avformat_find_stream_info(fmt, NULL) < 0 ||
+        (idx = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0)) < 0)
+        goto fail;
+    dec = avcodec_alloc_context3(codec);
+    avcodec_parameters_to_context(dec, fmt->streams[idx]->codecpar);
+    dec->thread_count = 1;              // callers decode several images at once
+    if (display) display_options(codec, &opts);
+    if (avcodec_open2(dec, codec, &opts) < 0) goto fail;
+    while (av_read_frame(fmt, pkt) >= 0) {
+        bool got = pkt->stream_index == idx && avcodec_send_packet(dec, pkt) >= 0 &&
+                   avcodec_receive_frame(dec, img) == 0;
+        av_packet_unref(pkt);
+        if (got) break;
+    }
+    if (!img->width) {
+        avcodec_send_packet(dec, NULL);
+        if (avcodec_receive_frame(dec, img) < 0) goto fail;
+    }
+    goto done;
+fail:
+    av_frame_free(&img);
+done:
+    av_dict_free(&opts);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt);
+    return img;
+}
+
+/* Any image FFmpeg decodes, 8 or 16 bits, greyscale or per channel;
+ * kept at 16 bits per channel so smooth ramps do not band */
+static int load_blend_mask(Output *o)
+{
+    AVFrame *img = load_image(o->mask_path, false), *rgb = av_frame_alloc();
+    struct SwsContext *sws = NULL;
+    int ret = -1;
+    if (!img) goto fail;
+
+    rgb->format = AV_PIX_FMT_RGB48LE;
+    rgb->width = img->width;
+    rgb->height = img->height;
+    sws = sws_getContext(img->width, img->height, (enum AVPixelFormat)img->format,
+                         img->width, img->height, AV_PIX_FMT_RGB48LE, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!sws || av_frame_get_buffer(rgb, 1) < 0) goto fail;
+    sws_scale(sws, img->data, img->linesize, 0, img->height, rgb->data, rgb->linesize);
+
+    glGenTextures(1, &o->mask);
+    glBindTexture(GL_TEXTURE_2D, o->mask);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, rgb->linesize[0] / 6);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, rgb->width, rgb->height, 0,
+                 GL_RGB, GL_UNSIGNED_SHORT, rgb->data[0]);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    printf("Output %d: blend mask %s, %dx%d\n", (int)(o - outputs), o->mask_path,
+           rgb->width, rgb->height);
+    ret = 0;
+fail:
+    if (ret < 0) fprintf(stderr, "Cannot load blend mask %s\n", o->mask_path);
+    sws_freeContext(sws);
+    av_frame_free(&rgb);
+    av_frame_free(&img);
+    return ret;
+}
+
+/* Spec: MONITOR[:MESHFILE[:MASKFILE]], an empty mesh keeps the plain quad */
+static bool add_output(const char *spec)
+{
+    if (noutputs == MAX_OUTPUTS) return false;
+    Output *o = &outputs[noutputs++];
+    char *end;
+    o->monitor = (int)strtol(spec, &end, 10);
+    if (end == spec || (*end && *end != ':')) return false;
+    for (int k = 0; k < 3; ++k) { o->gamma[k] = 2.2f; o->black[k] = 0.0f; }
+    if (!*end) return true;
+    char *mesh = strdup(end + 1), *mask = strchr(mesh, ':');
+    if (mask) *mask++ = 0;
+    o->mesh_path = *mesh ? mesh : NULL;
+    o->mask_path = mask && *mask ? mask : NULL;
+    return true;
+}
+
+/* --output-gamma / --output-black: "v" or "r,g,b" for the last output */
+static bool set_output_rgb(const char *val, bool gamma)
+{
+    if (!noutputs) return false;
+    float *dst = gamma ? outputs[noutputs - 1].gamma : outputs[noutputs - 1].black;
+    float r, g, b;
+    int n = sscanf(val, "%f,%f,%f", &r, &g, &b);
+    if (n == 1) g = b = r;
+    else if (n != 3) return false;
+    dst[0] = r; dst[1] = g; dst[2] = b;
+    return true;
+}
+
+static void key_callback(GLFWwindow *w, int key, int scancode, int action, int mods);
+
+/* Mesh (or a plain quad) and mask, in the current context */
+static int build_output(Output *o)
+{
+    if (o->mesh_path) {
+        if (load_warp_mesh(o) < 0) return -1;
+    } else {
+        float verts[] = { -1,1,0,1,1, -1,-1,0,0,1, 1,1,1,1,1, 1,-1,1,0,1 };
+        unsigned int idx[] = {0,1,2, 1,3,2};
+        make_mesh(verts, 4, idx, 6, &o->vao, &o->vbo, &o->ebo);
+        o->count = 6;
+    }
+    if (o->mask_path && load_blend_mask(o) < 0) return -1;
+    return 0;
+}
+
+/* Draw the current frame through o's mesh and mask into the bound
+ * framebuffer, w x h */
+static void draw_output(const Output *o, int w, int h)
+{
+    glViewport(0, 0, w, h);
+    glClear(GL_COLOR_BUFFER_BIT);
+    if (!shown_set) return;
+    glUseProgram(prog);
+    bind_set(shown_set);
+    glActiveTexture(GL_TEXTURE2); glBindTexture(GL_TEXTURE_2D, o->mask);
+    glUniform1i(locBlend, o->mask != 0);
+    glUniform2f(locViewport, (float)w, (float)h);
+    glUniform3fv(locGamma, 1, o->gamma);
+    glUniform3fv(locBlack, 1, o->black);
+    glBindVertexArray(o->vao);
+    glDrawElements(GL_TRIANGLES, o->count, GL_UNSIGNED_INT, 0);
+}
+
+static void free_output(Output *o)
+{
+    glDeleteVertexArrays(1, &o->vao); glDeleteBuffers(1, &o->vbo); glDeleteBuffers(1, &o->ebo);
+    glDeleteTextures(1, &o->mask);
+}
+
+static int open_outputs(GLFWwindow *share)
+{
+    int nmon = 0;
+    GLFWmonitor **mons = glfwGetMonitors(&nmon);
+    for (int i = 0; i < noutputs; ++i) {
+        Output *o = &outputs[i];
+        GLFWmonitor *mon = o->monitor >= 0 && o->monitor < nmon ? mons[o->monitor] : NULL;
+        if (o->monitor >= 0 && !mon)
+            printf("Output %d: no monitor %d, opening a window\n", i, o->monitor);
+        const GLFWvidmode *mode = mon ? glfwGetVideoMode(mon) : NULL;
+        char title[32];
+        snprintf(title, sizeof(title), "Output %d", i);
+        o->win = glfwCreateWindow(mode ? mode->width : WINDOW_WIDTH, mode ? mode->height : WINDOW_HEIGHT,
+                                  title, mon, share);
+        if (!o->win) { fprintf(stderr, "Output %d: cannot create window\n", i); return -1; }
+        glfwSetKeyCallback(o->win, key_callback);
+        glfwMakeContextCurrent(o->win);
+        glfwSwapInterval(i == 0);       // the projectors pace the loop, not every swap
+        if (build_output(o) < 0) return -1;
+    }
+    glfwMakeContextCurrent(share);
+    if (noutputs) glfwSwapInterval(0);  // the control window no longer blocks
+    return 0;
+}
+
+/* The frame was uploaded in the main context, or by the upload thread;
+ * every output samples the same textures. A context only sees another
+ * one's upload after waiting on its fence, so each output waits before
+ * drawing and the fence goes once all have. Leaves the main context
+ * current. */
+static void render_outputs(GLFWwindow *main_win)
+{
+    TextureSet *s = shown_set;
+    if (noutputs) {
+        glFlush();                      // make the upload visible to the other contexts
+        for (int i = 0; i < noutputs; ++i) {
+            Output *o = &outputs[i];
+            int w, h;
+            glfwMakeContextCurrent(o->win);
+            if (s && s->fence) glWaitSync(s->fence, 0, GL_TIMEOUT_IGNORED);
+            glfwGetFramebufferSize(o->win, &w, &h);
+            draw_output(o, w, h);
+            glfwSwapBuffers(o->win);
+        }
+        glfwMakeContextCurrent(main_win);
+    }
+    if (s && s->fence) {
+        glDeleteSync(s->fence);
+        s->fence = 0;
+    }
+}
+
+static void close_outputs(GLFWwindow *main_win)
+{
+    for (int i = 0; i < noutputs; ++i) {
+        Output *o = &outputs[i];
+        if (!o->win) continue;
+        glfwMakeContextCurrent(o->win);
+        free_output(o);
+        glfwDestroyWindow(o->win);
+    }
+    glfwMakeContextCurrent(main_win);
+}
+
+/* -------------------------------------------------------------
+ *  Audio callback (SDL)
+ * ------------------------------------------------------------- */
+/* The samples from byte pos of the stream start playing at wall time
+ * when; that fixes the offset between media and wall time. */
+static void audio_clock_sample(uint64_t pos, double when)
+{
+    while (audio_marks.size() > 1 && audio_marks[1].pos <= pos) audio_marks.pop_front();
+    if (audio_marks.empty() || audio_marks[0].pos > pos) return;
+    const AudioMark &m = audio_marks[0];
+    double bps = (double)audio_spec.freq * audio_spec.channels * 2;
+    double t = m.t + (pos - m.pos) / bps * m.rate;
+    double offset = t - m.rate * when;
+    if (isnan(aclock_offset) || m.rate != aclock_rate || fabs(offset - aclock_offset) > AUDIO_CLOCK_JUMP)
+        aclock_offset = offset;
+    else
+        aclock_offset += (offset - aclock_offset) / AUDIO_CLOCK_SMOOTH;
+    aclock_rate = m.rate;
+    aclock_wall = when;
+}
+
+/* One point per callback; a gap (device paused) starts a new fit */
+static void audio_drift_sample(double now, int len)
+{
+    double period = (double)audio_spec.samples / audio_spec.freq;
+    if (isnan(drift_anchor) || now - drift_last > 4 * period) {
+        drift_anchor = now;
+        audio_consumed = 0;
+        memset(drift_sum, 0, sizeof(drift_sum));
+    }
+    drift_last = now;
+    double x = now - drift_anchor;
+    double y = audio_consumed / ((double)audio_spec.freq * audio_spec.channels * 2) - x;
+    double keep = 1.0 - period / DRIFT_WINDOW;
+    for (double &v : drift_sum) v *= keep;
+    drift_sum[0] += 1.0;
+    drift_sum[1] += x;
+    drift_sum[2] += y;
+    drift_sum[3] += x * x;
+    drift_sum[4] += x * y;
+    audio_consumed += len;
+    double det = drift_sum[0] * drift_sum[3] - drift_sum[1] * drift_sum[1];
+    if (x >= DRIFT_MIN_SPAN && det > 0.0)
+        drift_ppm = (drift_sum[0] * drift_sum[4] - drift_sum[1] * drift_sum[2]) / det * 1e6;
+}
+
+/* Positive: the device plays fast against the system clock */
+static double audio_drift_ppm(void)
+{
+    if (!audio_dev) return NAN;
+    SDL_LockAudioDevice(audio_dev);
+    double ppm = drift_ppm;
+    SDL_UnlockAudioDevice(audio_dev);
+    return ppm;
+}
+
+/* With --drift-comp: resample by the measured drift, plus a pull on an
+ * A/V error (audio ahead positive) beyond the tolerance */
+static void steer_audio(double err)
+{
+    double ppm = audio_drift_ppm();
+    if (isnan(ppm)) ppm = 0.0;
+    if (fabs(err) > drift_tolerance) ppm += err / (speed * DRIFT_PULL) * 1e6;
+    comp_ppm = fmin(fmax(ppm, -DRIFT_MAX_PPM), DRIFT_MAX_PPM);
+}
+
+/* The chunk handed over now follows the one the device is playing, so
+ * it starts one buffer (plus any latency downstream of the device) later. */
+static void audio_callback(void *userdata, Uint8 *stream, int len)
+{
+    double now = glfwGetTime();
+    if (audio_buf_index >= audio_buf_size) {
+        SDL_memset(stream, 0, len);
+        audio_drift_sample(now, len);
+        return;
+    }
+    int copy = audio_buf_size - audio_buf_index;
+    if (copy > len) copy = len;
+    SDL_memcpy(stream, audio_buf + audio_buf_index, copy);
+    audio_buf_index += copy;
+    audio_clock_sample(audio_read, now + audio_latency);
+    audio_read += copy;
+    audio_drift_sample(now, len);
+    if (copy < len)
+        SDL_memset(stream + copy, 0, len - copy);
+}
+
+/* Media time being heard at wall time now, interpolated from the last
+ * callback; NAN when no audio has played for a few buffers. */
+static double audio_clock(double now)
+{
+    if (!audio_dev) return NAN;
+    SDL_LockAudioDevice(audio_dev);
+    double period = (double)audio_spec.samples / audio_spec.freq;
+    double t = now - aclock_wall < 4 * period ? aclock_offset + aclock_rate * now : NAN;
+    SDL_UnlockAudioDevice(audio_dev);
+    return t;
+}
+
+/* Append device-format samples behind what the callback has not played
+ * yet. The played part is dropped first so the buffer only holds the
+ * backlog. t is the media time of the first sample; NAN continues from
+ * the samples before. */
+static void audio_push(const uint8_t *data, uint32_t bytes, double t)
+{
+    if (!audio_dev || !bytes) return;
+    SDL_LockAudioDevice(audio_dev);
+    if (!isnan(t)) audio_marks.push_back({ audio_written, t, speed / (1.0 + comp_ppm * 1e-6) });
+    audio_written += bytes;
+    uint32_t pending = audio_buf_size - audio_buf_index;
+    if (audio_buf_index) {
+        memmove(audio_buf, audio_buf + audio_buf_index, pending);
+        audio_buf_index = 0;
+        audio_buf_size = pending;
+    }
+    if (audio_buf_alloc < pending + bytes) {
+        audio_buf_alloc = 2 * (pending + bytes);
+        audio_buf = (uint8_t*)av_realloc(audio_buf, audio_buf_alloc);
+    }
+    memcpy(audio_buf + audio_buf_size, data, bytes);
+    audio_buf_size += bytes;
+    SDL_UnlockAudioDevice(audio_dev);
+}
+
+static void audio_clear(void)
+{
+    if (!audio_dev) return;
+    SDL_LockAudioDevice(audio_dev);
+    audio_buf_index = audio_buf_size = 0;
+    audio_marks.clear();
+    audio_written = audio_read = 0;
+    aclock_offset = NAN;
+    aclock_wall = -INFINITY;
+    SDL_UnlockAudioDevice(audio_dev);
+}
+
+/* -------------------------------------------------------------
+ *  Audio conversion: any decoder output -> device S16
+ * ------------------------------------------------------------- */
+static int convert_audio(Clip *c, AVFrame *f)
+{
+    if (!c->swr) {
+        AVChannelLayout out;
+        av_channel_layout_default(&out, audio_spec.channels);
+        int ret = swr_alloc_set_opts2(&c->swr, &out, AV_SAMPLE_FMT_S16, audio_spec.freq,
+                                      &f->ch_layout, (enum AVSampleFormat)f->format,
+                                      f->sample_rate, 0, NULL);
+        av_channel_layout_uninit(&out);
+        if (ret < 0 || swr_init(c->swr) < 0) { swr_free(&c->swr); return -1; }
+        c->comp_carry = 0.0;
+    }
+    /* Drift compensation, spread over this frame's output; the fraction
+     * of a sample left over is carried to the next */
+    if (drift_tolerance > 0.0) {
+        int n = (int)av_rescale(f->nb_samples, audio_spec.freq, f->sample_rate);
+        double want = comp_ppm * 1e-6 * n + c->comp_carry;
+        int delta = (int)lrint(want);
+        if (n > 0 && swr_set_compensation(c->swr, delta, n) >= 0) c->comp_carry = want - delta;
+    }
+    int frame_bytes = audio_spec.channels * 2;
+    int max = swr_get_out_samples(c->swr, f->nb_samples);
+    av_fast_malloc(&c->abuf, &c->abuf_alloc, (size_t)max * frame_bytes);
+    if (!c->abuf) return -1;
+    int n = swr_convert(c->swr, &c->abuf, max,
+                        (const uint8_t * const *)f->extended_data, f->nb_samples);
+    return n < 0 ? n : n * frame_bytes;
+}
+
+/* Live clips feed the device; a clip still being pre-rolled keeps its
+ * audio aside until the cut. */
+static void queue_audio(Clip *c, const uint8_t *data, int bytes, double t)
+{
+    if (bytes <= 0) return;
+    if (c->live) { audio_push(data, bytes, t); return; }
+    if (!c->stash_size) c->stash_t = t;
+    c->stash = (uint8_t*)av_realloc(c->stash, c->stash_size + bytes);
+    memcpy(c->stash + c->stash_size, data, bytes);
+    c->stash_size += bytes;
+}
+
+/* -------------------------------------------------------------
+ *  Time stretch (WSOLA): each output hop crossfades from the natural
+ *  continuation of the last one into the input segment, near the
+ *  nominal position, that resembles it most. Pitch is unchanged.
+ * ------------------------------------------------------------- */
+#define WSOLA_HOP  0.020                // seconds per output hop (= crossfade)
+#define WSOLA_SEEK 0.008                // search range around the nominal position
+
+struct Stretch {
+    double speed;                       // what the state below was built for
+    std::vector<int16_t> in;            // interleaved input still needed
+    double t;                           // media time of in[0]
+    double pos;                         // nominal analysis position, frames into in
+    int natural;                        // where the last output segment continues
+    std::vector<int16_t> out;
+};
+
+static void stretch_reset(Clip *c)
+{
+    Stretch *s = c->stretch;
+    if (!s) return;
+    s->in.clear();
+    s->t = NAN;
+    s->pos = 0.0;
+    s->natural = 0;
+    s->speed = speed;
+}
+
+/* Device-format audio in, audio for the current speed out (in *out, which
+ * stays valid until the next call). Returns its size in bytes. t and *out_t
+ * are the media times of the first sample in and out. */
+static int stretch_audio(Clip *c, const uint8_t *data, int bytes, double t,
+                         const uint8_t **out, double *out_t)
+{
+    double sp = speed;
+    if (!c->stretch) { c->stretch = new Stretch(); stretch_reset(c); }
+    Stretch *s = c->stretch;
+    if (s->speed != sp) stretch_reset(c);
+    if (sp == 1.0) { *out = data; *out_t = t; return bytes; }
+
+    if (s->in.empty()) s->t = t;
+    *out_t = s->t + s->pos / audio_spec.freq;
+    int ch = audio_spec.channels;
+    int hop = (int)(WSOLA_HOP * audio_spec.freq);
+    int range = (int)(WSOLA_SEEK * audio_spec.freq);
+    const int16_t *src = (const int16_t*)data;
+    s->in.insert(s->in.end(), src, src + bytes / 2);
+    int frames = (int)(s->in.size() / ch);
+
+    s->out.clear();
+    for (;;) {
+        int nominal = (int)s->pos;
+        if (nominal + range + hop > frames || s->natural + hop > frames) break;
+
+        /* Normalised correlation on every other sample is plenty here */
+        const int16_t *ref = &s->in[(size_t)s->natural * ch];
+        int best = nominal;
+        double best_score = -INFINITY;
+        for (int cand = nominal > range ? nominal - range : 0; cand <= nominal + range; cand += 2) {
+            const int16_t *seg = &s->in[(size_t)cand * ch];
+            double xy = 0.0, yy = 1e-9;
+            for (int i = 0; i < hop * ch; i += 2 * ch)
+                for (int k = 0; k < ch; ++k) {
+                    double a = ref[i + k], b = seg[i + k];
+                    xy += a * b;
+                    yy += b * b;
+                }
+            double score = xy / sqrt(yy);
+            if (score > best_score) { best_score = score; best = cand; }
+        }
+
+        const int16_t *seg = &s->in[(size_t)best * ch];
+        for (int j = 0; j < hop; ++j) {
+            float w = 0.5f - 0.5f * cosf((float)M_PI * (j + 0.5f) / hop);
+            for (int k = 0; k < ch; ++k)
+                s->out.push_back((int16_t)lrintf(ref[j * ch + k] * (1.0f - w) + seg[j * ch + k] * w));
+        }
+        s->natural = best + hop;
+        s->pos += hop * sp;
+    }
+
+    /* Forget input neither the search nor the crossfade reaches again */
+    int drop = (int)s->pos - range;
+    if (drop > s->natural) drop = s->natural;
+    if (drop > 0) {
+        s->in.erase(s->in.begin(), s->in.begin() + (size_t)drop * ch);
+        s->t += (double)drop / audio_spec.freq;
+        s->pos -= drop;
+        s->natural -= drop;
+    }
+    *out = (const uint8_t*)s->out.data();
+    return (int)(s->out.size() * 2);
+}
+
+static void decode_audio(Clip *c, const AVPacket *p)
+{
+    if (avcodec_send_packet(c->adec, p) < 0) return;
+    AVRational tb = c->fmt->streams[c->aidx]->time_base;
+    int frame_bytes = audio_spec.channels * 2;
+    while (avcodec_receive_frame(c->adec, c->aframe) == 0) {
+        if (!audio_dev) continue;
+        AVFrame *f = c->aframe;
+        double t0 = f->pts != AV_NOPTS_VALUE ? f->pts * av_q2d(tb) : NAN;
+        double t1 = t0 + (double)f->nb_samples / f->sample_rate;
+
+        /* After a loop the samples already in the cached head are cut */
+        int skip = 0;
+        if (c->audio_skip && !isnan(t0)) {
+            if (t1 <= c->audio_skip_until) continue;
+            if (t0 < c->audio_skip_until)
+                skip = (int)((c->audio_skip_until - t0) * audio_spec.freq) * frame_bytes;
+        }
+        c->audio_skip = false;
+
+        int bytes = convert_audio(c, f);
+        if (bytes <= skip) continue;
+        if (c->caching_head) {
+            c->head_audio = (uint8_t*)av_realloc(c->head_audio, c->head_audio_size + bytes);
+            memcpy(c->head_audio + c->head_audio_size, c->abuf, bytes);
+            c->head_audio_size += bytes;
+            c->head_audio_end = t1;
+        }
+        const uint8_t *out;
+        double t = t0 + (double)skip / frame_bytes / audio_spec.freq;
+        bytes = stretch_audio(c, c->abuf + skip, bytes - skip, t, &out, &t);
+        queue_audio(c, out, bytes, t);
+    }
+}
+
+/* -------------------------------------------------------------
+ *  Open / close a clip
+ * ------------------------------------------------------------- */
+
+/* sel is a stream index or a language tag ("eng"); without one, or if
+ * nothing matches, the first stream of the type is used */
+static int pick_stream(AVFormatContext *fmt, enum AVMediaType type, const char *sel)
+{
+    int first = -1;
+    for (unsigned i = 0; i < fmt->nb_streams; ++i) {
+        AVStream *st = fmt->streams[i];
+        if (st->codecpar->codec_type != type) continue;
+        if (first < 0) first = i;
+        if (!sel) break;
+        if (isdigit((unsigned char)sel[0])) {
+            if (atoi(sel) == (int)i) return i;
+            continue;
+        }
+        AVDictionaryEntry *lang = av_dict_get(st->metadata, "language", NULL, 0);
+        if (lang && !strcasecmp(lang->value, sel)) return i;
+    }
+    if (sel && first >= 0)
+        fprintf(stderr, "No %s stream '%s', using #%d\n",
+                type == AVMEDIA_TYPE_VIDEO ? "video" : "audio", sel, first);
+    return first;
+}
+
+static int open_clip(Clip *c, const char *path)
+{
+    c->path = path;
+    c->vidx = c->aidx = -1;
+    c->io = seq_active ? NULL : io_backend;     // image2 opens every file itself
+    if (c->io && open_custom_io(path, NULL, &c->fmt, &c->pb, &c->io_opaque) < 0) return -1;
+    AVDictionary *opts = NULL;
+    if (seq_active) {
+        av_dict_set_int(&opts, "start_number", seq_first, 0);
+        if (seq_fps > 0) {
+            char rate[32];
+            snprintf(rate, sizeof(rate), "%g", seq_fps);
+            av_dict_set(&opts, "framerate", rate, 0);
+        }
+    }
+    int ret = avformat_open_input(&c->fmt, path, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) return -1;
+    if (avformat_find_stream_info(c->fmt, NULL) < 0) return -1;
+
+    c->vidx = pick_stream(c->fmt, AVMEDIA_TYPE_VIDEO, vstream_sel);
+    c->aidx = pick_stream(c->fmt, AVMEDIA_TYPE_AUDIO, astream_sel);
+    if (c->vidx < 0) return -1;
+
+    /* Everything else (other languages, data, timecode, subtitles) is
+     * skipped by the demuxer instead of being read and thrown away */
+    for (unsigned i = 0; i < c->fmt->nb_streams; ++i)
+        if ((int)i != c->vidx && (int)i != c->aidx)
+            c->fmt->streams[i]->discard = AVDISCARD_ALL;
+
+    c->duration = c->fmt->duration * 1e-6;  // seconds
+
+    /* --- Video --- */
+    AVCodecParameters *vpar = c->fmt->streams[c->vidx]->codecpar;
+    const AVCodec *vcodec = avcodec_find_decoder(vpar->codec_id);
+    c->vdec = avcodec_alloc_context3(vcodec);
+    avcodec_parameters_to_context(c->vdec, vpar);
+    if (init_hw_decoder(c->vdec) < 0)
+        printf("No HW decoder, using software\n");
+    display_options(vcodec, &opts);
+    ret = avcodec_open2(c->vdec, vcodec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) return -1;
+    c->hap = hap_passthrough(vpar);
+
+    /* --- Audio --- */
+    if (c->aidx >= 0) {
+        AVCodecParameters *apar = c->fmt->streams[c->aidx]->codecpar;
+        const AVCodec *acodec = avcodec_find_decoder(apar->codec_id);
+        c->adec = avcodec_alloc_context3(acodec);
+        avcodec_parameters_to_context(c->adec, apar);
+        if (avcodec_open2(c->adec, acodec, NULL) < 0)
+            avcodec_free_context(&c->adec);
+    }
+
+    /* --- Split readers: audio gets its own demuxer and file position --- */
+    if (split_readers && c->adec) {
+        if (c->io && open_custom_io(path, c->io_opaque, &c->afmt, &c->apb, &c->aio_opaque) < 0)
+            return -1;
+        if (avformat_open_input(&c->afmt, path, NULL, NULL) < 0) return -1;
+        if ((int)c->afmt->nb_streams <= c->aidx && avformat_find_stream_info(c->afmt, NULL) < 0)
+            return -1;
+        for (unsigned i = 0; i < c->afmt->nb_streams; ++i)
+            if ((int)i != c->aidx) c->afmt->streams[i]->discard = AVDISCARD_ALL;
+        c->fmt->streams[c->aidx]->discard = AVDISCARD_ALL;
+        c->apkt = av_packet_alloc();
+    }
+
+    c->pkt = av_packet_alloc();
+    c->vframe = av_frame_alloc();
+    c->swframe = av_frame_alloc();
+    c->nv12 = av_frame_alloc();
+    if (c->adec) c->aframe = av_frame_alloc();
+    return 0;
+}
+
+static void clip_drop_preroll(Clip *c)
+{
+    for (int i = c->preroll_pos; i < c->npreroll; ++i)
+        av_frame_free(&c->preroll[i]);
+    c->npreroll = c->preroll_pos = 0;
+    av_freep(&c->stash);
+    c->stash_size = 0;
+}
+
+static void close_clip(Clip *c)
+{
+    clip_drop_preroll(c);
+    for (int i = 0; i < c->nhead; ++i)
+        av_frame_free(&c->head[i]);
+    av_freep(&c->head_audio);
+    av_packet_free(&c->pkt);
+    av_frame_free(&c->vframe);
+    av_frame_free(&c->aframe);
+    av_frame_free(&c->swframe);
+    av_frame_free(&c->nv12);
+    avcodec_free_context(&c->vdec);
+    avcodec_free_context(&c->adec);
+    avformat_close_input(&c->afmt);
+    close_custom_io(c->io, &c->apb, &c->aio_opaque);
+    avformat_close_input(&c->fmt);
+    close_custom_io(c->io, &c->pb, &c->io_opaque);
+    av_packet_free(&c->apkt);
+    av_buffer_pool_uninit(&c->hap_pool);
+    sws_freeContext(c->sws);
+    swr_free(&c->swr);
+    av_freep(&c->abuf);
+    delete c->stretch;
+    memset(c, 0, sizeof(*c));
+}
+
+/* -------------------------------------------------------------
+ *  Adaptive decode: give up quality before giving up sync
+ * ------------------------------------------------------------- */
+#define LOAD_WINDOW    0.5   // seconds of media per measurement
+#define LOAD_DEGRADE   0.90  // decode time / media time that steps down
+#define LOAD_RECOVER   0.60  // ... and that steps back up
+#define LOAD_HOLD_DOWN 1.0   // wall seconds between steps down
+#define LOAD_HOLD_UP   5.0   // ... and before a step up (doubles on flapping)
+
+enum { DECODE_FULL, DECODE_NO_DEBLOCK, DECODE_NONREF, DECODE_KEYFRAMES };
+static const char *decode_level_name[] = {
+    "full", "no loop filter", "no non-reference frames", "keyframes only"
+};
+
+static bool adaptive = false;
+static int decode_level = DECODE_FULL;
+static double load = 0.0;               // last measured decode time / media time
+static double load_busy = 0.0, load_media = 0.0, load_last_pts = NAN;
+static double load_changed = -1e9, load_hold_up = LOAD_HOLD_UP;
+static bool load_stepped_up = false;
+
+/* Mosaic tiles never skip for lateness or speed: tiles would drop
+ * different frames and the picture would tear */
+static void apply_decode_level(AVCodecContext *dec)
+{
+    int skip = decode_level;
+    if (!ntiles && (late_skip || speed >= SPEED_NONREF) && skip < DECODE_NONREF) skip = DECODE_NONREF;
+    dec->skip_loop_filter = decode_level >= DECODE_NO_DEBLOCK ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+    dec->skip_frame = skip >= DECODE_KEYFRAMES ? AVDISCARD_NONKEY :
+                      skip >= DECODE_NONREF    ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
+
+/* The render thread's changes of level. While the loop thread is catching
+ * up on the same decoder they wait for finish_catch_up; mosaic tiles keep
+ * what they were opened with, their threads own the decoders. */
+static bool decode_level_deferred = false;
+
+static void refresh_decode_level(Clip *c)
+{
+    if (ntiles) return;
+    if (loop_thread.joinable()) {
+        decode_level_deferred = true;
+        return;
+    }
+    apply_decode_level(c->vdec);
+}
+
+static void set_late_skip(Clip *c, bool on)
+{
+    if (on == late_skip) return;
+    late_skip = on;
+    refresh_decode_level(c);
+}
+
+/* busy: seconds the render thread spent reading and decoding up to the
+ * frame at t. Load is measured against the media time that covered. */
+static void update_load(Clip *c, double busy, double t)
+{
+    if (!isnan(load_last_pts) && t > load_last_pts && t - load_last_pts < 1.0) {
+        load_busy += busy;
+        load_media += t - load_last_pts;
+    }
+    load_last_pts = t;
+    if (load_media < LOAD_WINDOW) return;
+    load = load_busy / load_media;
+    load_busy = load_media = 0.0;
+
+    double now = av_gettime_relative() / 1e6;
+    int level = decode_level;
+    if (load > LOAD_DEGRADE && level < DECODE_KEYFRAMES && now - load_changed > LOAD_HOLD_DOWN) {
+        /* Straight back down after a step up: wait longer next time */
+        if (load_stepped_up && now - load_changed < 2 * LOAD_HOLD_DOWN && load_hold_up < 60.0)
+            load_hold_up *= 2;
+        level++;
+    } else if (load < LOAD_RECOVER && level > DECODE_FULL && now - load_changed > load_hold_up) {
+        level--;
+    }
+    if (level == decode_level) return;
+
+    printf("Decoder load %.0f%%: %s -> %s\n", load * 100.0,
+           decode_level_name[decode_level], decode_level_name[level]);
+    load_stepped_up = level < decode_level;
+    decode_level = level;
+    load_changed = now;
+    refresh_decode_level(c);
+}
+
+/* -------------------------------------------------------------
+ *  Decoding
+ * ------------------------------------------------------------- */
+
+/* Bytes of converted audio waiting for the device (or in the stash) */
+static uint32_t audio_queued(Clip *c)
+{
+    if (!c->live) return c->stash_size;
+    SDL_LockAudioDevice(audio_dev);
+    uint32_t n = audio_buf_size - audio_buf_index;
+    SDL_UnlockAudioDevice(audio_dev);
+    return n;
+}
+
+/* Split readers: the audio demuxer reads on its own until AUDIO_AHEAD
+ * seconds are queued, however far the video packets are from it. */
+static void feed_audio(Clip *c)
+{
+    if (!audio_dev) return;
+    uint32_t target = (uint32_t)(AUDIO_AHEAD * audio_spec.freq) * audio_spec.channels * 2;
+    while (!c->aeof && audio_queued(c) < target) {
+        if (av_read_frame(c->afmt, c->apkt) < 0) {
+            c->aeof = true;
+            decode_audio(c, NULL);
+            break;
+        }
+        if (c->apkt->stream_index == c->aidx) decode_audio(c, c->apkt);
+        av_packet_unref(c->apkt);
+    }
+}
+
+/* Point the split audio reader at t seconds; decoders are flushed by the caller */
+static void seek_audio_reader(Clip *c, double t)
+{
+    if (!c->afmt) return;
+    av_seek_frame(c->afmt, -1, (int64_t)(t * AV_TIME_BASE), AVSEEK_FLAG_BACKWARD);
+    c->aeof = false;
+}
+
+/* Read packets until the next video frame is in c->vframe, decoding the
+ * audio met on the way. Returns AVERROR_EOF once the video is drained. */
+static int decode_video_frame(Clip *c)
+{
+    for (;;) {
+        if (c->afmt && !c->video_only) feed_audio(c);
+        int ret = avcodec_receive_frame(c->vdec, c->vframe);
+        if (ret == 0) return 0;
+        if (ret != AVERROR(EAGAIN) || c->eof) return AVERROR_EOF;
+
+        if (av_read_frame(c->fmt, c->pkt) < 0) {
+            c->eof = true;
+            avcodec_send_packet(c->vdec, NULL);
+            if (c->adec && !c->afmt && !c->video_only) decode_audio(c, NULL);
+            continue;
+        }
+        if (c->pkt->stream_index == c->vidx && c->hap) {
+            ret = hap_unpack(c, c->pkt);
+            av_packet_unref(c->pkt);
+            if (ret == 0) return 0;
+            continue;
+        }
+        if (c->pkt->stream_index == c->vidx)
+            avcodec_send_packet(c->vdec, c->pkt);
+        else if (c->pkt->stream_index == c->aidx && c->adec && !c->video_only)
+            decode_audio(c, c->pkt);
+        av_packet_unref(c->pkt);
+    }
+}
+
+/* A frame that may be held for a long time. Hardware surfaces are
+ * downloaded so the decoder's fixed pool is not starved. */
+static AVFrame *keep_frame(const AVFrame *f)
+{
+    AVFrame *k = av_frame_alloc();
+    if (!k) return NULL;
+    int ret = f->hw_frames_ctx ? av_hwframe_transfer_data(k, f, 0) : av_frame_ref(k, f);
+    if (ret >= 0 && f->hw_frames_ctx) ret = av_frame_copy_props(k, f);
+    if (ret < 0) av_frame_free(&k);
+    return k;
+}
+
+static void cache_head_frame(Clip *c)
+{
+    AVFrame *f = c->vframe;
+    if (c->nhead == 0) c->head_start = f->best_effort_timestamp;
+    double t = (f->best_effort_timestamp - c->head_start) *
+               av_q2d(c->fmt->streams[c->vidx]->time_base);
+    AVFrame *k = NULL;
+    if (t < LOOP_HEAD_SECONDS && c->nhead < LOOP_HEAD_MAX && (k = keep_frame(f))) {
+        c->head[c->nhead++] = k;
+        c->head_end = f->best_effort_timestamp;
+        return;
+    }
+    c->caching_head = false;
+    printf("Loop head: %d frames, %.1f MB audio\n", c->nhead, c->head_audio_size / 1048576.0);
+}
+
+/* Loop-thread body: seek back to the end of the cached head and decode up
+ * to the first frame after it, while the main thread replays the head. */
+static void catch_up(Clip *c)
+{
+    av_seek_frame(c->fmt, c->vidx, c->head_end, AVSEEK_FLAG_BACKWARD);
+    seek_audio_reader(c, c->head_audio_end);
+    avcodec_flush_buffers(c->vdec);
+    if (c->adec) avcodec_flush_buffers(c->adec);
+    c->eof = false;
+    c->audio_skip = c->head_audio_size > 0;
+    c->audio_skip_until = c->head_audio_end;
+    while (decode_video_frame(c) == 0) {
+        if (c->vframe->best_effort_timestamp > c->head_end) {
+            c->pending = true;
+            break;
+        }
+    }
+}
+
+/* At EOF in loop mode: queue the head audio, replay the head frames and
+ * let the decoder catch up in the background. */
+static void loop_to_head(Clip *c)
+{
+    if (c->nhead == 0) {
+        av_seek_frame(c->fmt, -1, 0, AVSEEK_FLAG_BACKWARD);
+        seek_audio_reader(c, 0.0);
+        avcodec_flush_buffers(c->vdec);
+        if (c->adec) avcodec_flush_buffers(c->adec);
+        c->eof = false;
+        return;
+    }
+    const uint8_t *out;
+    double t = c->head_audio_end - (double)c->head_audio_size / (audio_spec.channels * 2) / audio_spec.freq;
+    stretch_reset(c);
+    int bytes = stretch_audio(c, c->head_audio, c->head_audio_size, t, &out, &t);
+    audio_push(out, bytes, t);
+    c->replaying = true;
+    c->replay_pos = 0;
+    c->live = false;
+    loop_thread = std::thread(catch_up, c);
+}
+
+static void finish_catch_up(Clip *c)
+{
+    if (!loop_thread.joinable()) return;
+    loop_thread.join();
+    if (decode_level_deferred) {
+        decode_level_deferred = false;
+        apply_decode_level(c->vdec);
+    }
+    audio_push(c->stash, c->stash_size, c->stash_t);
+    av_freep(&c->stash);
+    c->stash_size = 0;
+    c->live = true;
+}
+
+/* Frame to present next: pre-rolled or cached-head frames come before the
+ * decoder is touched. Returns NULL at EOF. */
+static AVFrame *mosaic_next(void);
+static AVFrame *seq_next(void);
+
+static AVFrame *next_video_frame(Clip *c)
+{
+    if (ntiles) return mosaic_next();
+    if (seq_active) return seq_next();
+    if (c->preroll_pos < c->npreroll) {
+        av_frame_unref(c->vframe);
+        av_frame_move_ref(c->vframe, c->preroll[c->preroll_pos]);
+        av_frame_free(&c->preroll[c->preroll_pos++]);
+        return c->vframe;
+    }
+    if (c->replaying) {
+        if (c->replay_pos < c->nhead) return c->head[c->replay_pos++];
+        c->replaying = false;
+    }
+    finish_catch_up(c);
+    if (c->pending) {
+        c->pending = false;
+        return c->vframe;
+    }
+    int64_t t0 = av_gettime_relative();
+    if (decode_video_frame(c) < 0) return NULL;
+    if (adaptive && c->vframe->best_effort_timestamp != AV_NOPTS_VALUE)
+        update_load(c, (av_gettime_relative() - t0) / 1e6, c->vframe->best_effort_timestamp *
+                    av_q2d(c->fmt->streams[c->vidx]->time_base));
+    if (c->caching_head) cache_head_frame(c);
+    return c->vframe;
+}
+
+/* Convert a decoded frame to NV12, downloading it first when it was
+ * hardware decoded. The target follows the frame size, which may change
+ * from one clip to the next. */
+/* Deep video keeps its bits for the HDR path */
+static enum AVPixelFormat upload_format(enum AVPixelFormat src)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src);
+    return desc && desc->comp[0].depth > 8 ? AV_PIX_FMT_P010LE : AV_PIX_FMT_NV12;
+}
+
+/* Convert src into dst (NV12 or P010) with its top left corner at x, y
+ * (even). For YUV only the layout changes: the shader applies matrix and
+ * range, so full-range (J) input stays full range instead of being
+ * squeezed. RGB (image sequences, Hap decoded on the CPU) is encoded here
+ * as full-range BT.709 and tagged so, the matrix the shader inverts. */
+static int convert_into(Clip *c, AVFrame *src, AVFrame *dst, int x, int y)
+{
+    if (src->hw_frames_ctx) {
+        av_frame_unref(c->swframe);
+        if (av_hwframe_transfer_data(c->swframe, src, 0) < 0) return -1;
+        src = c->swframe;
+    }
+    c->sws = sws_getCachedContext(c->sws, src->width, src->height, (enum AVPixelFormat)src->format,
+                                  src->width, src->height, (enum AVPixelFormat)dst->format,
+                                  SWS_BILINEAR, NULL, NULL, NULL);
+    if (!c->sws) return -1;
+    enum AVPixelFormat fmt = (enum AVPixelFormat)src->format;
+    bool jpeg = fmt == AV_PIX_FMT_YUVJ420P || fmt == AV_PIX_FMT_YUVJ422P || fmt == AV_PIX_FMT_YUVJ444P ||
+                fmt == AV_PIX_FMT_YUVJ440P || fmt == AV_PIX_FMT_YUVJ411P;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+    bool rgb = desc && (desc->flags & AV_PIX_FMT_FLAG_RGB);
+    bool full = rgb || jpeg || src->color_range == AVCOL_RANGE_JPEG;
+    int *inv, *tbl, src_full, dst_full, bri, con, sat;
+    sws_getColorspaceDetails(c->sws, &inv, &src_full, &tbl, &dst_full, &bri, &con, &sat);
+    const int *coefs = rgb ? sws_getCoefficients(SWS_CS_ITU709) : tbl;
+    if (src_full != full || dst_full != full || memcmp(tbl, coefs, 4 * sizeof(int)))  // fresh context only
+        sws_setColorspaceDetails(c->sws, inv, full, coefs, full, bri, con, sat);
+
+    int bpc = dst->format == AV_PIX_FMT_P010LE ? 2 : 1;
+    uint8_t *planes[4] = { dst->data[0] + (size_t)y * dst->linesize[0] + (size_t)x * bpc,
+                           dst->data[1] + (size_t)(y / 2) * dst->linesize[1] + (size_t)x * bpc };
+    sws_scale(c->sws, src->data, src->linesize, 0, src->height, planes, dst->linesize);
+    dst->colorspace = rgb ? AVCOL_SPC_BT709 : src->colorspace;
+    dst->color_range = full ? AVCOL_RANGE_JPEG : src->color_range;
+    dst->color_primaries = src->color_primaries;
+    dst->color_trc = src->color_trc;
+    return 0;
+}
+
+static bool mosaic_frame(const AVFrame *f);
+
+static AVFrame *convert_frame(Clip *c, AVFrame *src)
+{
+    if (mosaic_frame(src) || src == seq_shown) return src;  // converted by the decoding threads
+    if (hap_frame(src)) return src;     // texture blocks, uploaded as they are
+    enum AVPixelFormat dst = upload_format((enum AVPixelFormat)(src->hw_frames_ctx
+        ? ((AVHWFramesContext*)src->hw_frames_ctx->data)->sw_format : src->format));
+    if (c->nv12->width != src->width || c->nv12->height != src->height || c->nv12->format != dst ||
+        !av_frame_is_writable(c->nv12)) {       // still queued for the upload thread
+        av_frame_unref(c->nv12);
+        c->nv12->format = dst;
+        c->nv12->width = src->width;
+        c->nv12->height = src->height;
+        if (av_frame_get_buffer(c->nv12, 1) < 0) return NULL;
+    }
+    if (convert_into(c, src, c->nv12, 0, 0) < 0) return NULL;
+    for (int i = 0; i < 2; ++i) {       // HDR metadata, by reference
+        enum AVFrameSideDataType type = i ? AV_FRAME_DATA_CONTENT_LIGHT_LEVEL
+                                          : AV_FRAME_DATA_MASTERING_DISPLAY_METADATA;
+        av_frame_remove_side_data(c->nv12, type);
+        const AVFrameSideData *sd = av_frame_get_side_data(src, type);
+        AVBufferRef *ref = sd ? av_buffer_ref(sd->buf) : NULL;
+        if (ref && !av_frame_new_side_data_from_buf(c->nv12, type, ref)) av_buffer_unref(&ref);
+    }
+    return c->nv12;
+}
+
+/* -------------------------------------------------------------
+ *  Rehearsal transport: pause, frame steps and reverse play are served
+ *  from a cache of whole decoded GOPs filled by a worker thread
+ * ------------------------------------------------------------- */
+#define CACHE_PREFETCH 2.0              // seconds decoded behind the playhead
+
+enum { TRANSPORT_PLAY, TRANSPORT_PAUSE, TRANSPORT_REVERSE };
+static const char *transport_name[] = { "playing", "paused", "reverse" };
+
+struct FrameCache {
+    std::mutex lock;
+    std::condition_variable wake;
+    std::map<int64_t, AVFrame*> frames; // by best-effort pts
+    std::map<int64_t, int64_t> gops;    // first pts -> next keyframe pts (INT64_MAX at EOF)
+    int64_t first_gop;                  // nothing decodable before this
+    size_t bytes;
+    int64_t want;                       // playhead the worker decodes around
+    int dir;                            // -1 reverse, 0 paused
+    bool quit;
+};
+
+static FrameCache fcache;
+static size_t cache_budget = (size_t)1024 << 20;
+static std::thread gop_thread;
+static int transport = TRANSPORT_PLAY;
+static int transport_request = -1, step_request = 0;
+static int64_t shown_ts = AV_NOPTS_VALUE;       // pts of the frame on screen
+static int64_t cache_goto = AV_NOPTS_VALUE;     // seek while not playing
+static int64_t rev_anchor_ts;
+static double rev_anchor_wall;
+static AVFrame *cache_view = NULL;
+
+/* The decoded GOP containing t, or NULL. Lock held. */
+static const std::pair<const int64_t, int64_t> *gop_covering(int64_t t)
+{
+    auto it = fcache.gops.upper_bound(t);
+    if (it == fcache.gops.begin()) return NULL;
+    --it;
+    return t < it->second ? &*it : NULL;
+}
+
+static size_t frame_size(const AVFrame *f)
+{
+    size_t n = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && f->buf[i]; ++i) n += f->buf[i]->size;
+    return n;
+}
+
+/* Worker: seek to the keyframe at or before t and decode up to the next
+ * one. Returns the first pts of the GOP. */
+static int64_t decode_gop(Clip *c, int64_t t)
+{
+    av_seek_frame(c->fmt, c->vidx, t, AVSEEK_FLAG_BACKWARD);
+    avcodec_flush_buffers(c->vdec);
+    c->eof = false;
+
+    int64_t start = AV_NOPTS_VALUE, end = INT64_MAX;
+    std::vector<AVFrame*> got;
+    while (decode_video_frame(c) == 0) {
+        int64_t ts = c->vframe->best_effort_timestamp;
+        if (ts == AV_NOPTS_VALUE) continue;
+        if (start == AV_NOPTS_VALUE) start = ts;
+        else if ((c->vframe->flags & AV_FRAME_FLAG_KEY) && ts > start) { end = ts; break; }
+        if (ts < start) continue;
+        AVFrame *k = keep_frame(c->vframe);
+        if (k) got.push_back(k);
+    }
+
+    std::lock_guard<std::mutex> lk(fcache.lock);
+    for (AVFrame *f : got) {
+        int64_t ts = f->best_effort_timestamp;
+        if (fcache.frames.count(ts)) { av_frame_free(&f); continue; }
+        fcache.frames[ts] = f;
+        fcache.bytes += frame_size(f);
+    }
+    if (start != AV_NOPTS_VALUE) fcache.gops[start] = end;
+    return start;
+}
+
+/* Drop whole GOPs, farthest from the playhead first. Lock held. */
+static void cache_evict(int64_t t)
+{
+    while (fcache.bytes > cache_budget && fcache.gops.size() > 1) {
+        auto far = fcache.gops.end();
+        int64_t far_dist = -1;
+        for (auto it = fcache.gops.begin(); it != fcache.gops.end(); ++it) {
+            if (t >= it->first && t < it->second) continue;
+            int64_t d = t < it->first ? it->first - t : t - it->second;
+            if (d > far_dist) { far_dist = d; far = it; }
+        }
+        if (far == fcache.gops.end()) break;
+        auto f0 = fcache.frames.lower_bound(far->first);
+        auto f1 = fcache.frames.lower_bound(far->second);
+        for (auto it = f0; it != f1; ++it) {
+            fcache.bytes -= frame_size(it->second);
+            av_frame_free(&it->second);
+        }
+        fcache.frames.erase(f0, f1);
+        fcache.gops.erase(far);
+    }
+}
+
+static void gop_worker(Clip *c)
+{
+    AVRational tb = c->fmt->streams[c->vidx]->time_base;
+    std::unique_lock<std::mutex> lk(fcache.lock);
+    while (!fcache.quit) {
+        int64_t t = fcache.want, target = AV_NOPTS_VALUE;
+        const auto *g = gop_covering(t);
+        if (!g) {
+            target = t;
+        } else if (fcache.dir >= 0 && g->second != INT64_MAX && !gop_covering(g->second)) {
+            target = g->second;
+        } else {
+            /* Keep CACHE_PREFETCH seconds behind the playhead decoded */
+            int64_t s = g->first;
+            while (s > fcache.first_gop && (t - s) * av_q2d(tb) < CACHE_PREFETCH) {
+                const auto *p = gop_covering(s - 1);
+                if (!p) { target = s - 1; break; }
+                s = p->first;
+            }
+        }
+        if (target == AV_NOPTS_VALUE) {
+            cache_evict(t);
+            fcache.wake.wait(lk);
+            continue;
+        }
+
+        lk.unlock();
+        int64_t start = decode_gop(c, target);
+        lk.lock();
+        if (start == AV_NOPTS_VALUE) {
+            fcache.gops[target] = target + 1;   // nothing decodable there
+        } else if (start > target) {
+            /* The seek could not go back any further: the first GOP
+             * starts at target as far as lookups are concerned */
+            int64_t end = fcache.gops[start];
+            fcache.gops.erase(start);
+            fcache.gops[target] = end;
+            fcache.first_gop = target;
+        }
+        cache_evict(t);
+    }
+}
+
+/* Neighbours of ts, only when their GOP is known to be complete. Lock held. */
+static AVFrame *cache_prev(int64_t ts, int64_t *out)
+{
+    if (!gop_covering(ts - 1)) return NULL;
+    auto it = fcache.frames.lower_bound(ts);
+    if (it == fcache.frames.begin()) return NULL;
+    --it;
+    *out = it->first;
+    return it->second;
+}
+
+static AVFrame *cache_next(int64_t ts, int64_t *out)
+{
+    const auto *g = gop_covering(ts);
+    if (!g) return NULL;
+    auto it = fcache.frames.upper_bound(ts);
+    if (it == fcache.frames.end()) return NULL;
+    if (it->first >= g->second && !gop_covering(g->second)) return NULL;
+    *out = it->first;
+    return it->second;
+}
+
+/* Leave the forward pipeline: the worker owns the demuxer and decoder
+ * from here on, audio is paused. */
+static void enter_cache_mode(Clip *c)
+{
+    finish_catch_up(c);
+    clip_drop_preroll(c);
+    c->replaying = c->pending = c->caching_head = false;
+    c->video_only = true;
+    c->vdec->skip_frame = AVDISCARD_DEFAULT;  // every frame is wanted here
+    c->vdec->skip_loop_filter = AVDISCARD_DEFAULT;
+    if (audio_dev) SDL_PauseAudioDevice(audio_dev, 1);
+    audio_clear();
+
+    cache_view = av_frame_alloc();
+    fcache.want = shown_ts;
+    fcache.dir = 0;
+    fcache.first_gop = INT64_MIN;
+    fcache.quit = false;
+    gop_thread = std::thread(gop_worker, c);
+}
+
+static void leave_cache_mode(Clip *c)
+{
+    {
+        std::lock_guard<std::mutex> lk(fcache.lock);
+        fcache.quit = true;
+    }
+    fcache.wake.notify_one();
+    gop_thread.join();
+    for (auto &it : fcache.frames) av_frame_free(&it.second);
+    fcache.frames.clear();
+    fcache.gops.clear();
+    fcache.bytes = 0;
+    av_frame_free(&cache_view);
+
+    c->video_only = false;
+    apply_decode_level(c->vdec);
+    if (audio_dev) SDL_PauseAudioDevice(audio_dev, 0);
+}
+
+/* Per vsync while not playing forward: pick the frame to show from the
+ * cache. Returns it (a reference in cache_view) when it changed. */
+static AVFrame *cache_present(Clip *c, double now)
+{
+    AVRational tb = c->fmt->streams[c->vidx]->time_base;
+    std::lock_guard<std::mutex> lk(fcache.lock);
+    AVFrame *show = NULL, *f;
+    int64_t ts = shown_ts, t;
+
+    if (cache_goto != AV_NOPTS_VALUE) {
+        fcache.want = cache_goto;
+        const auto *g = gop_covering(cache_goto);
+        auto it = fcache.frames.upper_bound(cache_goto);
+        if (g && it != fcache.frames.begin() && std::prev(it)->first >= g->first) --it;
+        if (g && it != fcache.frames.end()) {
+            show = it->second;
+            ts = it->first;
+            cache_goto = AV_NOPTS_VALUE;
+            rev_anchor_ts = ts;
+            rev_anchor_wall = now;
+        }
+    } else if (transport == TRANSPORT_REVERSE) {
+        int64_t target = rev_anchor_ts - (int64_t)((now - rev_anchor_wall) * speed / av_q2d(tb));
+        while (ts > target && (f = cache_prev(ts, &t))) { show = f; ts = t; }
+        if (ts > target) {
+            const auto *g = gop_covering(ts);
+            if (g && g->first == fcache.first_gop &&
+                fcache.frames.lower_bound(g->first)->first == ts) {
+                transport = TRANSPORT_PAUSE;    // reached the first frame
+            } else {
+                rev_anchor_ts = ts;             // worker behind: stall the clock
+                rev_anchor_wall = now;
+            }
+        }
+    } else if (step_request < 0 && (f = cache_prev(ts, &t))) {
+        show = f; ts = t; step_request = 0;
+    } else if (step_request > 0 && (f = cache_next(ts, &t))) {
+        show = f; ts = t; step_request = 0;
+    }
+
+    fcache.want = cache_goto != AV_NOPTS_VALUE ? cache_goto : ts;
+    fcache.dir = transport == TRANSPORT_REVERSE ? -1 : 0;
+    fcache.wake.notify_one();
+    if (!show) return NULL;
+    shown_ts = ts;
+    pts = ts * av_q2d(tb);
+    av_frame_unref(cache_view);
+    return av_frame_ref(cache_view, show) < 0 ? NULL : cache_view;
+}
+
+/* -------------------------------------------------------------
+ *  Playlist: pre-roll the next clip on a helper thread
+ * ------------------------------------------------------------- */
+static int preroll_clip(Clip *c, const char *path)
+{
+    if (open_clip(c, path) < 0) return -1;
+    while (c->npreroll < PREROLL_FRAMES && decode_video_frame(c) == 0)
+        c->preroll[c->npreroll++] = av_frame_clone(c->vframe);
+    return c->npreroll > 0 ? 0 : -1;
+}
+
+static void start_preroll(void)
+{
+    next = NULL;
+    if (playlist_pos + 1 >= playlist_len && !loop_mode) return;
+
+    Clip *c = (cur == &clips[0]) ? &clips[1] : &clips[0];
+    const char *path = playlist[(playlist_pos + 1) % playlist_len];
+    next = c;
+    preroll_done = false;
+    preroll_thread = std::thread([c, path] {
+        preroll_status = preroll_clip(c, path);
+        preroll_done = true;
+    });
+}
+
+/* Cut to the pre-rolled clip. Its stashed audio goes straight behind
+ * what is still queued for the device, so there is no gap. A single clip
+ * in loop mode wraps to its cached head instead. Returns false at the end
+ * of the playlist. */
+static void mosaic_seek(int64_t target);
+static void mosaic_start(int64_t from);
+static void seq_seek(int64_t target);
+
+static bool advance_playlist(void)
+{
+    if (ntiles || seq_active) {         // one source, not a playlist
+        if (!loop_mode) return false;
+        if (seq_active) {
+            seq_seek(0);
+        } else {
+            mosaic_seek(0);
+            mosaic_start(AV_NOPTS_VALUE);
+        }
+        return true;
+    }
+    if (loop_mode && playlist_len == 1) {
+        loop_to_head(cur);
+        return true;
+    }
+    int failed = 0;
+    while (next) {
+        if (!preroll_done) printf("Waiting for %s to open\n", next->path);
+        preroll_thread.join();
+        Clip *c = next;
+        playlist_pos = (playlist_pos + 1) % playlist_len;
+        if (preroll_status < 0) {
+            fprintf(stderr, "Failed to open %s, skipping\n", c->path);
+            close_clip(c);
+            if (++failed >= playlist_len) return false;
+            start_preroll();
+            continue;
+        }
+
+        close_clip(cur);
+        cur = c;
+        audio_push(cur->stash, cur->stash_size, cur->stash_t);
+        av_freep(&cur->stash);
+        cur->stash_size = 0;
+        cur->live = true;
+        printf("Playing %d/%d: %s\n", playlist_pos + 1, playlist_len, cur->path);
+        apply_decode_level(cur->vdec);
+        start_preroll();
+        return true;
+    }
+    return false;
+}
+
+/* -------------------------------------------------------------
+ *  Image sequences: numbered files (name_%05d.exr) decoded by a pool of
+ *  threads, each file start to finish, and handed over in order from
+ *  a reorder buffer that bounds how far the pool runs ahead. The image2
+ *  demuxer still opens the sequence for its timing and for the frame cache.
+ * ------------------------------------------------------------- */
+#define SEQ_AHEAD 24                    // frames decoded ahead of the one shown
+#define SEQ_THREADS_MAX 16
+
+static const char *seq_pattern = NULL;
+static std::vector<std::thread> seq_pool;
+static std::mutex seq_lock;
+static std::condition_variable seq_cond;
+static std::map<int, AVFrame*> seq_ready;      // converted frames by index
+static int seq_job = 0, seq_read = 0;   // next index to decode, next to show
+static bool seq_quit = false;
+static bool is_sequence(const char *path)
+{
+    const char *p = strchr(path, '%');
+    if (!p) return false;
+    while (isdigit((unsigned char)*++p)) {}
+    return *p == 'd';
+}
+
+/* The lowest number the pattern's file name part matches in its
+ * directory, one pass over the listing; -1 if none does */
+static int seq_lowest(const char *pattern)
+{
+    const char *slash = strrchr(pattern, '/');
+    const char *name = slash ? slash + 1 : pattern;
+    const char *pct = strchr(name, '%');
+    if (!pct) return -1;                // the number is in a directory name
+    char dir[4096], path[4096];
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(name - pattern) : 2, slash ? pattern : "./");
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    size_t prefix = pct - name;
+    int lowest = -1;
+    while (struct dirent *e = readdir(d)) {
+        const char *digits = e->d_name + prefix;
+        if (strncmp(e->d_name, name, prefix) || !isdigit((unsigned char)*digits)) continue;
+        long n = strtol(digits, NULL, 10);
+        if (n >= 10000000 || (lowest >= 0 && n >= lowest)) continue;
+        /* Formatted back, so width, padding and suffix all have to match */
+        snprintf(path, sizeof(path), name, (int)n);
+        if (!strcmp(path, e->d_name)) lowest = (int)n;
+    }
+    closedir(d);
+    return lowest;
+}
+
+/* Find the first file (image2 only probes 0-4, VFX renders start at
+ * 1001) and count the files that follow without a gap */
+static int seq_open(const char *pattern)
+{
+    char path[4096];
+    struct stat st;
+    seq_pattern = pattern;
+    seq_first = seq_lowest(pattern);
+    if (seq_first < 0) { fprintf(stderr, "No files match %s\n", pattern); return -1; }
+    for (seq_count = 0; seq_first + seq_count < 10000000; ++seq_count) {
+        snprintf(path, sizeof(path), pattern, seq_first + seq_count);
+        if (stat(path, &st) != 0) break;
+    }
+    if (!seq_count) { fprintf(stderr, "No files match %s\n", pattern); return -1; }
+    seq_active = true;
+    return 0;
+}
+
+static void seq_worker(void)
+{
+    Clip conv = {};                     // this thread's swscale state
+    char path[4096];
+    std::unique_lock<std::mutex> lk(seq_lock);
+    while (!seq_quit) {
+        if (seq_job >= seq_count || seq_job >= seq_read + SEQ_AHEAD) {
+            seq_cond.wait(lk);
+            continue;
+        }
+        int i = seq_job++;
+        lk.unlock();
+
+        snprintf(path, sizeof(path), seq_pattern, seq_first + i);
+        AVFrame *img = load_image(path, true), *f = NULL;
+        if (img) {
+            f = av_frame_alloc();
+            f->format = upload_format((enum AVPixelFormat)img->format);
+            f->width = img->width;
+            f->height = img->height;
+            if (av_frame_get_buffer(f, 0) < 0 || convert_into(&conv, img, f, 0, 0) < 0)
+                av_frame_free(&f);
+            else
+                f->best_effort_timestamp = i;
+        }
+        if (!f) fprintf(stderr, "%s: cannot decode, skipped\n", path);
+        av_frame_free(&img);
+
+        lk.lock();
+        seq_ready[i] = f;
+        seq_cond.notify_all();
+    }
+    sws_freeContext(conv.sws);
+}
+
+static void seq_start(void)
+{
+    int n = (int)std::thread::hardware_concurrency() - 1;
+    if (n < 2) n = 2;
+    if (n > SEQ_THREADS_MAX) n = SEQ_THREADS_MAX;
+    seq_quit = false;
+    for (int i = 0; i < n; ++i) seq_pool.emplace_back(seq_worker);
+}
+
+static void seq_stop(void)
+{
+    {
+        std::lock_guard<std::mutex> lk(seq_lock);
+        seq_quit = true;
+    }
+    seq_cond.notify_all();
+    for (std::thread &t : seq_pool) t.join();
+    seq_pool.clear();
+    for (auto &it : seq_ready) av_frame_free(&it.second);
+    seq_ready.clear();
+    av_frame_free(&seq_shown);
+}
+
+/* Stop the pool and restart it at the frame covering target */
+static void seq_seek(int64_t target)
+{
+    seq_stop();
+    int64_t i = av_rescale_q(target, AV_TIME_BASE_Q, cur->fmt->streams[cur->vidx]->time_base);
+    seq_read = seq_job = (int)(i < 0 ? 0 : i < seq_count ? i : seq_count - 1);
+    seq_start();
+}
+
+/* The next frame in order, NULL after the last one. The previous one is
+ * freed: the caller has shown or dropped it by now. */
+static AVFrame *seq_next(void)
+{
+    std::unique_lock<std::mutex> lk(seq_lock);
+    av_frame_free(&seq_shown);
+    while (seq_read < seq_count) {
+        seq_cond.wait(lk, [] { return seq_ready.count(seq_read) > 0; });
+        auto it = seq_ready.find(seq_read);
+        AVFrame *f = it->second;
+        seq_ready.erase(it);
+        seq_read++;
+        seq_cond.notify_all();
+        if (f) return seq_shown = f;
+    }
+    return NULL;
+}
+
+/* -------------------------------------------------------------
+ *  Mosaic: one picture delivered as several synchronised files. Every
+ *  tile has its own demuxer, decoder and thread, and converts straight
+ *  into its region of a shared frame. Slot n is shown once every tile
+ *  has filled it, each with its frame at tile 0's time for the slot: a
+ *  frame a tile lacks is repeated, one it has extra is dropped, so one
+ *  lost or corrupt frame never shifts the ones after it.
+ * ------------------------------------------------------------- */
+#define MOSAIC_SLOTS 3                  // one shown, two being filled
+
+typedef struct MosaicSlot {
+    AVFrame *frame;
+    int64_t seq;                        // the frame number this slot holds next
+    int filled;                         // tiles done with it
+    int64_t pts;                        // tile 0's, in its time base
+    bool timed;                         // tile 0 has set time
+    int64_t time;                       // tile 0's, see tile_time
+} MosaicSlot;
+
+static Clip *tile_clips = NULL;         // tile 0 is cur: clock, audio, UI
+static std::thread *tile_threads = NULL;
+static MosaicSlot mosaic_slots[MOSAIC_SLOTS];
+static std::mutex mosaic_lock;
+static std::condition_variable mosaic_cond;
+static int64_t mosaic_read = 0;         // next sequence number to show
+static bool mosaic_holding = false;     // the slot before mosaic_read is on screen
+static bool mosaic_eof = false, mosaic_quit = false;
+static int64_t mosaic_half_frame = 0;   // AV_TIME_BASE: tolerance of a tile's time
+
+static bool mosaic_frame(const AVFrame *f)
+{
+    for (int i = 0; ntiles && i < MOSAIC_SLOTS; ++i)
+        if (f == mosaic_slots[i].frame) return true;
+    return false;
+}
+
+/* The decoded frame's time from the start of its file, AV_TIME_BASE:
+ * comparable between tiles whatever their time bases and start times */
+static int64_t tile_time(Clip *c)
+{
+    AVStream *st = c->fmt->streams[c->vidx];
+    int64_t ts = c->vframe->best_effort_timestamp;
+    if (ts == AV_NOPTS_VALUE) return AV_NOPTS_VALUE;
+    if (st->start_time != AV_NOPTS_VALUE) ts -= st->start_time;
+    return av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q);
+}
+
+static void tile_worker(int i, int64_t from)
+{
+    Clip *c = &tile_clips[i];
+    int x = (i % mosaic_cols) * c->vdec->width, y = (i / mosaic_cols) * c->vdec->height;
+    int64_t skip = from == AV_NOPTS_VALUE ? AV_NOPTS_VALUE
+                 : av_rescale_q(from, AV_TIME_BASE_Q, c->fmt->streams[c->vidx]->time_base);
+    AVFrame *held = av_frame_alloc();   // the last frame placed, repeated for a lost one
+    bool pending = false;               // c->vframe is decoded but not placed yet
+    for (int64_t seq = 0;; ++seq) {
+        MosaicSlot *s = &mosaic_slots[seq % MOSAIC_SLOTS];
+        AVFrame *src = c->vframe;
+        for (;;) {
+            int ret = 0;
+            if (!pending) {
+                while ((ret = decode_video_frame(c)) == 0 && skip != AV_NOPTS_VALUE &&
+                       c->vframe->best_effort_timestamp != AV_NOPTS_VALUE &&
+                       c->vframe->best_effort_timestamp < skip) {}
+                skip = AV_NOPTS_VALUE;
+                pending = ret == 0;
+            }
+            std::unique_lock<std::mutex> lk(mosaic_lock);
+            if (ret < 0) { mosaic_eof = true; mosaic_cond.notify_all(); goto done; }
+            mosaic_cond.wait(lk, [&] { return mosaic_quit || (s->seq == seq && (i == 0 || s->timed)); });
+            if (mosaic_quit) goto done;
+            int64_t t = tile_time(c);
+            if (i == 0) {
+                s->pts = c->vframe->best_effort_timestamp;
+                s->time = t;
+                s->timed = true;
+                mosaic_cond.notify_all();
+                break;
+            }
+            if (t == AV_NOPTS_VALUE || s->time == AV_NOPTS_VALUE) break;
+            if (t < s->time - mosaic_half_frame) {      // tile 0 has no such frame
+                pending = false;
+                continue;
+            }
+            if (t > s->time + mosaic_half_frame && held->buf[0]) src = held;  // this tile lost one
+            break;
+        }
+
+        int ret = convert_into(c, src, s->frame, x, y);
+        if (src == c->vframe) {
+            av_frame_unref(held);
+            if (av_frame_ref(held, c->vframe) < 0) av_frame_unref(held);
+            pending = false;
+        }
+
+        std::lock_guard<std::mutex> lk(mosaic_lock);
+        if (ret < 0) mosaic_eof = true;
+        s->filled++;
+        mosaic_cond.notify_all();
+    }
+done:
+    av_frame_free(&held);
+}
+
+/* Open every file and check they form one grid of equal tiles */
+static int mosaic_open(void)
+{
+    ntiles = playlist_len;
+    tile_clips = new Clip[ntiles]();
+    tile_threads = new std::thread[ntiles];
+    cur = &tile_clips[0];
+    for (int i = 0; i < ntiles; ++i) {
+        Clip *c = &tile_clips[i];
+        if (open_clip(c, playlist[i]) < 0) {
+            fprintf(stderr, "Mosaic: cannot open %s\n", playlist[i]);
+            return -1;
+        }
+        if (c->vdec->width != cur->vdec->width || c->vdec->height != cur->vdec->height) {
+            fprintf(stderr, "Mosaic: %s is %dx%d, tile 1 is %dx%d\n", c->path, c->vdec->width,
+                    c->vdec->height, cur->vdec->width, cur->vdec->height);
+            return -1;
+        }
+        if (i > 0 && c->aidx >= 0) {    // the first tile carries the sound
+            c->fmt->streams[c->aidx]->discard = AVDISCARD_ALL;
+            c->video_only = true;
+        }
+        apply_decode_level(c->vdec);
+    }
+
+    enum AVPixelFormat fmt = upload_format((enum AVPixelFormat)cur->fmt->streams[cur->vidx]->codecpar->format);
+    for (int k = 0; k < MOSAIC_SLOTS; ++k) {
+        AVFrame *f = mosaic_slots[k].frame = av_frame_alloc();
+        f->format = fmt;
+        f->width = mosaic_cols * cur->vdec->width;
+        f->height = mosaic_rows * cur->vdec->height;
+        if (av_frame_get_buffer(f, 0) < 0) return -1;
+    }
+    AVRational fr = cur->fmt->streams[cur->vidx]->avg_frame_rate;
+    mosaic_half_frame = (int64_t)(AV_TIME_BASE / 2 / (fr.num > 0 && fr.den > 0 ? av_q2d(fr) : 30.0));
+    printf("Mosaic: %dx%d tiles of %dx%d, %dx%d picture\n", mosaic_cols, mosaic_rows,
+           cur->vdec->width, cur->vdec->height, mosaic_slots[0].frame->width, mosaic_slots[0].frame->height);
+    return 0;
+}
+
+/* Start decoding, from a seek target (AV_TIME_BASE) or where the files are */
+static void mosaic_start(int64_t from)
+{
+    for (int k = 0; k < MOSAIC_SLOTS; ++k) {
+        mosaic_slots[k].seq = k;
+        mosaic_slots[k].filled = 0;
+        mosaic_slots[k].timed = false;
+    }
+    mosaic_read = 0;
+    mosaic_holding = false;
+    mosaic_eof = mosaic_quit = false;
+    for (int i = 0; i < ntiles; ++i) tile_threads[i] = std::thread(tile_worker, i, from);
+}
+
+static void mosaic_stop(void)
+{
+    {
+        std::lock_guard<std::mutex> lk(mosaic_lock);
+        mosaic_quit = true;
+    }
+    mosaic_cond.notify_all();
+    for (int i = 0; i < ntiles; ++i)
+        if (tile_threads[i].joinable()) tile_threads[i].join();
+}
+
+static void mosaic_seek(int64_t target)
+{
+    mosaic_stop();
+    for (int i = 0; i < ntiles; ++i) {
+        Clip *c = &tile_clips[i];
+        av_seek_frame(c->fmt, -1, target, AVSEEK_FLAG_BACKWARD);
+        seek_audio_reader(c, target / (double)AV_TIME_BASE);
+        avcodec_flush_buffers(c->vdec);
+        if (c->adec) avcodec_flush_buffers(c->adec);
+        c->eof = false;
+    }
+}
+
+/* The next complete picture, NULL at the end of any tile. Hands the
+ * previous one back to the tile threads. */
+static AVFrame *mosaic_next(void)
+{
+    std::unique_lock<std::mutex> lk(mosaic_lock);
+    if (mosaic_holding) {
+        MosaicSlot *done = &mosaic_slots[(mosaic_read - 1) % MOSAIC_SLOTS];
+        done->seq += MOSAIC_SLOTS;
+        done->filled = 0;
+        done->timed = false;
+        mosaic_holding = false;
+        mosaic_cond.notify_all();
+    }
+    MosaicSlot *s = &mosaic_slots[mosaic_read % MOSAIC_SLOTS];
+    mosaic_cond.wait(lk, [&] { return s->filled == ntiles || mosaic_eof; });
+    if (s->filled < ntiles) return NULL;
+    mosaic_read++;
+    mosaic_holding = true;
+    s->frame->best_effort_timestamp = s->pts;
+    return s->frame;
+}
+
+static void mosaic_close(void)
+{
+    mosaic_stop();
+    for (int i = 0; i < ntiles; ++i) close_clip(&tile_clips[i]);
+    for (int k = 0; k < MOSAIC_SLOTS; ++k) av_frame_free(&mosaic_slots[k].frame);
+    delete[] tile_threads;
+    delete[] tile_clips;
+    ntiles = 0;
+    cur = &clips[0];
+}
+
+/* -------------------------------------------------------------
+ *  Main loop
+ * ------------------------------------------------------------- */
+/* The mosaic, the sequence or the first clip of the playlist */
+static int open_playback(void)
+{
+    if (mosaic_cols) {
+        if (mosaic_open() < 0) {
+            mosaic_close();
+            return -1;
+        }
+        playlist_len = 1;
+    } else if (is_sequence(playlist[0])) {
+        if (seq_open(playlist[0]) < 0 || open_clip(cur, playlist[0]) < 0) {
+            fprintf(stderr, "Failed to open sequence\n");
+            close_clip(cur);
+            return -1;
+        }
+        playlist_len = 1;
+        AVRational fr = cur->fmt->streams[cur->vidx]->avg_frame_rate;
+        if (fr.num > 0 && fr.den > 0) cur->duration = seq_count / av_q2d(fr);
+        printf("Sequence: %d frames from %d\n", seq_count, seq_first);
+    } else if (open_clip(cur, playlist[0]) < 0) {
+        fprintf(stderr, "Failed to open file\n");
+        close_clip(cur);
+        return -1;
+    }
+    return 0;
+}
+
+/* Decoding helpers: tile threads, the sequence pool or the preroll */
+static void start_playback(void)
+{
+    cur->live = true;
+    cur->caching_head = loop_mode && playlist_len == 1 && !ntiles;
+    apply_decode_level(cur->vdec);      // --speed may already skip non-ref frames
+    if (ntiles) mosaic_start(AV_NOPTS_VALUE);
+    else if (seq_active) seq_start();
+    else start_preroll();
+}
+
+static void close_playback(void)
+{
+    if (preroll_thread.joinable()) preroll_thread.join();
+    if (loop_thread.joinable()) loop_thread.join();
+    if (next) close_clip(next);
+    if (ntiles) mosaic_close();
+    else close_clip(cur);
+    if (seq_active) seq_stop();
+    av_freep(&audio_buf);
+    av_buffer_unref(&hw_device_ctx);
+}
+
+static void run(GLFWwindow *win)
+{
+    if (open_playback() < 0) return;
+
+    /* --- Audio init --- */
+    /* A playlist opens the device even when the first clip is silent,
+     * later clips are converted to whatever format it got. */
+    if (cur->adec || playlist_len > 1) {
+        SDL_AudioSpec want = {0};
+        want.freq = cur->adec ? cur->adec->sample_rate : 48000;
+        want.format = AUDIO_S16SYS;
+        want.channels = cur->adec ? cur->adec->ch_layout.nb_channels : 2;
+        want.samples = 1024;
+        want.callback = audio_callback;
+        audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &audio_spec, 0);
+        audio_latency = (double)audio_spec.samples / audio_spec.freq + audio_latency_extra;
+        if (audio_dev) SDL_PauseAudioDevice(audio_dev, 0);
+    }
+    start_playback();
+
+    /* Master clock: media time runs at speed from where it was last set */
+    set_media_clock(glfwGetTime(), 0.0);
+    bool rebase = true;                 // next frame defines the clock (start, cut, loop)
+    double seek_until = -INFINITY;
+    double last_t = NAN;
+    double drift_logged = glfwGetTime();
+
+    while (!glfwWindowShouldClose(win)) {
+        double now = glfwGetTime();
+
+        /* --- Speed: the clock keeps its position, audio is re-stretched --- */
+        if (speed_request > 0.0 && speed_request != speed) {
+            set_media_clock(now, media_clock(now));
+            rev_anchor_ts = shown_ts;
+            rev_anchor_wall = now;
+            speed = speed_request;
+            audio_clear();
+            if (transport == TRANSPORT_PLAY) refresh_decode_level(cur);
+        }
+        speed_request = 0.0;
+
+        /* --- Transport --- */
+        if (transport_request >= 0 && transport_request != transport && shown_set && !ntiles) {
+            if (transport == TRANSPORT_PLAY) {
+                ring_flush();
+                enter_cache_mode(cur);
+            } else if (transport_request == TRANSPORT_PLAY) {
+                leave_cache_mode(cur);
+                seek_target = (int64_t)(pts * AV_TIME_BASE);
+                seeking = true;
+            }
+            rev_anchor_ts = shown_ts;
+            rev_anchor_wall = now;
+            transport = transport_request;
+        }
+        transport_request = -1;
+        if (transport == TRANSPORT_PLAY) step_request = 0;
+        if (seeking && transport != TRANSPORT_PLAY) {
+            cache_goto = av_rescale_q(seek_target, AV_TIME_BASE_Q, cur->fmt->streams[cur->vidx]->time_base);
+            seeking = false;
+        }
 
         /* --- Seeking --- */
         if (seeking) {
-            av_seek_frame(fmt, -1, seek_target * AV_TIME_BASE, AVSEEK_FLAG_BACKWARD);
-            avcodec_flush_buffers(vdec);
-            if (adec) avcodec_flush_buffers(adec);
-            start = now - (seek_target / 1000000.0);
+            if (ntiles) {
+                mosaic_seek(seek_target);
+            } else if (seq_active) {
+                seq_seek(seek_target);
+            } else {
+                finish_catch_up(cur);
+                clip_drop_preroll(cur);
+                cur->replaying = cur->pending = cur->caching_head = false;
+                av_seek_frame(cur->fmt, -1, seek_target, AVSEEK_FLAG_BACKWARD);
+                seek_audio_reader(cur, seek_target / (double)AV_TIME_BASE);
+                avcodec_flush_buffers(cur->vdec);
+                if (cur->adec) avcodec_flush_buffers(cur->adec);
+                cur->eof = false;
+            }
+            stretch_reset(cur);
+            set_media_clock(now, seek_target / 1000000.0);
+            seek_until = seek_target / 1000000.0;
+            ring_flush();
+            last_t = NAN;
             seeking = false;
-            audio_buf_index = audio_buf_size = 0;
-        }
-
-        /* --- Decode loop --- */
-        int got_video = 0;
-        while (!got_video) {
-            if (av_read_frame(fmt, &pkt) < 0) goto end;
-            if (pkt.stream_index == vidx) {
-                avcodec_send_packet(vdec, &pkt);
-                if (avcodec_receive_frame(vdec, vframe) == 0) {
-                    if (vframe->pts != AV_NOPTS_VALUE)
-                        pts = vframe->pts * av_q2d(fmt->streams[vidx]->time_base);
-                    got_video = 1;
-                }
-            } else if (aidx >= 0 && pkt.stream_index == aidx && adec) {
-                avcodec_send_packet(adec, &pkt);
-                while (avcodec_receive_frame(adec, aframe) == 0) {
-                    int samples = aframe->nb_samples * aframe->ch_layout.nb_channels;
-                    int bytes = samples * 2;
-                    if ((uint32_t)(audio_buf_size - audio_buf_index) < (uint32_t)bytes) {
-                        audio_buf_size = audio_buf_index + bytes;
-                        audio_buf = (uint8_t*)av_realloc(audio_buf, audio_buf_size);
-                    }
-                    int16_t *dst = (int16_t*)(audio_buf + audio_buf_index);
-                    for (int i = 0; i < samples; ++i)
-                        dst[i] = ((int16_t*)aframe->data[0])[i];
-                    audio_buf_index += bytes;
-                }
+            audio_clear();
+            if (ntiles) mosaic_start(seek_target);
+        }
+
+        /* --- Video slaves to the audio being heard; across a cut the old
+         *     clip's audio is still playing and the clock runs free --- */
+        double heard = transport == TRANSPORT_PLAY && !rebase ? audio_clock(now) : NAN;
+        double av_err = heard - media_clock(now);
+        if (!isnan(heard) && fabs(av_err) < AUDIO_SLAVE_MAX) {
+            if (drift_tolerance > 0.0 && fabs(av_err) < DRIFT_RESYNC) {
+                steer_audio(av_err);    // --drift-comp: the audio follows instead
+            } else {
+                av_correction = av_err;
+                set_media_clock(now, heard);
+            }
+        }
+        if (audio_dev && now - drift_logged >= DRIFT_LOG && !isnan(audio_drift_ppm())) {
+            printf("Audio drift (%s): %+.1f ppm, A/V %+.2f ms, compensation %+.1f ppm\n",
+                   SDL_GetCurrentAudioDriver(), audio_drift_ppm(), av_err * 1e3, comp_ppm.load());
+            drift_logged = now;
+        }
+
+        /* --- Decode: late frames are dropped before any conversion, the
+         *     rest are uploaded ahead into the texture ring --- */
+        double frame_dur = 1.0 / 30.0;
+        AVRational fr = cur->fmt->streams[cur->vidx]->avg_frame_rate;
+        if (fr.num > 0 && fr.den > 0) frame_dur = 1.0 / av_q2d(fr);
+
+        for (int n = 0; transport == TRANSPORT_PLAY && ring_free() && n < MAX_DROPS_PER_VSYNC; ++n) {
+            AVFrame *frame;
+            while (!(frame = next_video_frame(cur))) {
+                if (!advance_playlist()) goto end;
+                rebase = true;
+                seek_until = -INFINITY;
+                last_t = NAN;
+            }
+            double t = frame->best_effort_timestamp != AV_NOPTS_VALUE
+                     ? frame->best_effort_timestamp * av_q2d(cur->fmt->streams[cur->vidx]->time_base)
+                     : media_clock(now);
+            if (rebase || t - media_clock(now) > 2.0) {  // timestamp jump: follow it
+                set_media_clock(now, t);
+                rebase = false;
             }
-            av_packet_unref(&pkt);
+            if (!isnan(last_t) && t - last_t > 1.5 * frame_dur)
+                drops[DROP_DECODER] += (uint64_t)((t - last_t) / frame_dur + 0.5) - 1;
+            last_t = t;
+
+            if (t < seek_until) { drops[DROP_SEEK]++; continue; }
+            double late = media_clock(now) - t;
+            set_late_skip(cur, late > LATE_SKIP);
+            if (late > frame_dur) { drops[DROP_LATE]++; continue; }
+            AVFrame *nv12 = convert_frame(cur, frame);
+            if (nv12) ring_queue(nv12, nv12->width, nv12->height, t, frame->best_effort_timestamp);
         }
 
-        if (got_video && video_time - last_video >= 1.0 / 30.0) {  // ~30 FPS cap
-            sws_scale(sws, vframe->data, vframe->linesize, 0, vdec->height,
-                      nv12->data, nv12->linesize);
-            render_frame(nv12, vdec->width, vdec->height);
-            last_video = video_time;
+        /* --- Present: the newest uploaded set that is due --- */
+        AVFrame *nv12 = NULL;
+        if (transport != TRANSPORT_PLAY) {
+            AVFrame *f = cache_present(cur, now);
+            if (f) nv12 = convert_frame(cur, f);
+        } else if (TextureSet *s = ring_pick(media_clock(now))) {
+            pts = s->t;
+            shown_ts = s->ts;
         }
+        render_frame(nv12, nv12 ? nv12->width : 0, nv12 ? nv12->height : 0);
 
         /* --- ImGui --- */
         ImGui_ImplOpenGL3_NewFrame();
@@ -349,42 +3740,842 @@ static void run(GLFWwindow *win, const char *path)
         ImGui::NewFrame();
 
         ImGui::Begin("Controls", NULL, ImGuiWindowFlags_AlwaysAutoResize);
-        float pos = (float)(pts / duration * 100.0f);
+        float pos = cur->duration > 0 ? (float)(pts / cur->duration * 100.0f) : 0.0f;
         if (ImGui::SliderFloat("##seek", &pos, 0.0f, 100.0f, "%.2f %%")) {
-            seek_target = (int64_t)(pos / 100.0 * duration * AV_TIME_BASE);
+            seek_target = (int64_t)(pos / 100.0 * cur->duration * AV_TIME_BASE);
             seeking = true;
         }
-        ImGui::Text("Duration: %.1f s", duration);
+        if (playlist_len > 1)
+            ImGui::Text("Clip %d/%d: %s", playlist_pos + 1, playlist_len, cur->path);
+        if (ImGui::Button("<<")) transport_request = TRANSPORT_REVERSE;
+        ImGui::SameLine();
+        if (ImGui::Button("|<")) { transport_request = TRANSPORT_PAUSE; step_request = -1; }
+        ImGui::SameLine();
+        if (ImGui::Button(transport == TRANSPORT_PLAY ? "||" : ">"))
+            transport_request = transport == TRANSPORT_PLAY ? TRANSPORT_PAUSE : TRANSPORT_PLAY;
+        ImGui::SameLine();
+        if (ImGui::Button(">|")) { transport_request = TRANSPORT_PAUSE; step_request = 1; }
+        ImGui::SameLine();
+        ImGui::Text("%s", transport_name[transport]);
+        float sp = (float)speed;
+        if (ImGui::SliderFloat("Speed", &sp, SPEED_MIN, SPEED_MAX, "%.2fx")) speed_request = sp;
+        if (transport != TRANSPORT_PLAY)
+            ImGui::Text("Frame cache: %.0f / %.0f MB, %d GOPs", fcache.bytes / 1048576.0,
+                        cache_budget / 1048576.0, (int)fcache.gops.size());
+        if (hap_mode)
+            ImGui::Text("Video: %s, compressed texture", hap_name(shown_set->hap_type));
+        if (color_tags.space >= 0)
+            ImGui::Text("Colour: %s, %s range", av_color_space_name((enum AVColorSpace)color_tags.space),
+                        av_color_range_name((enum AVColorRange)color_tags.range));
+        ImGui::Text("Duration: %.1f s", cur->duration);
         ImGui::Text("Position: %.2f s", pts);
+        if (adaptive)
+            ImGui::Text("Decode: %s (load %.0f%%)", decode_level_name[decode_level], load * 100.0);
+        for (int i = 0; i < DROP_CAUSES; ++i)
+            if (drops[i]) ImGui::Text("Dropped (%s): %llu", drop_cause_name[i], (unsigned long long)drops[i]);
+        if (!isnan(audio_clock(now)))
+            ImGui::Text("Audio clock: last step %+.2f ms, latency %.1f ms", av_correction * 1e3, audio_latency * 1e3);
+        if (!isnan(audio_drift_ppm()))
+            ImGui::Text("Audio drift (%s): %+.1f ppm, compensation %+.1f ppm", SDL_GetCurrentAudioDriver(),
+                        audio_drift_ppm(), comp_ppm.load());
+        if (upload_win && upload_count)
+            ImGui::Text("Upload thread: %.2f ms/frame", upload_us / 1e3 / upload_count);
+        if (cur->io && cur->io->report) cur->io->report(cur->io_opaque);
+        if (seq_active) {
+            std::lock_guard<std::mutex> lk(seq_lock);
+            ImGui::Text("Sequence: frame %d/%d, %d decoded ahead", seq_read, seq_count, (int)seq_ready.size());
+        }
         ImGui::End();
 
         ImGui::Render();
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
+        render_outputs(win);
         glfwSwapBuffers(win);
         glfwPollEvents();
     }
 
 end:
-    av_free(buf);
-    av_frame_free(&nv12);
-    av_frame_free(&vframe);
-    av_frame_free(&aframe);
-    avcodec_free_context(&vdec);
-    if (adec) avcodec_free_context(&adec);
-    avformat_close_input(&fmt);
+    if (gop_thread.joinable()) leave_cache_mode(cur);
+    if (drops[DROP_LATE] || drops[DROP_DECODER])
+        printf("Dropped frames: %llu late, %llu skipped in decoder\n",
+               (unsigned long long)drops[DROP_LATE], (unsigned long long)drops[DROP_DECODER]);
     if (audio_dev) SDL_CloseAudioDevice(audio_dev);
-    av_buffer_unref(&hw_device_ctx);
+    close_playback();
+}
+
+/* -------------------------------------------------------------
+ *  Headless: an EGL surfaceless context (a GPU's render node, or Mesa's
+ *  llvmpipe) with no window, no ImGui and no audio. Every frame is
+ *  decoded, uploaded and warped into an FBO as fast as it goes, timed,
+ *  and optionally read back.
+ * ------------------------------------------------------------- */
+static bool headless = false;
+static int headless_w = 0, headless_h = 0;  // 0: the first frame's size
+static int headless_frames = 0;         // --frames: stop after N, 0 at the end
+static const char *dump_pattern = NULL; // --dump: every frame as a PPM file
+static const char *golden_dir = NULL;   // --golden: run the image tests against DIR
+static bool golden_update = false;      // --golden-update: write DIR's references
+
+#ifdef HAVE_EGL
+enum { STAT_DECODE, STAT_CONVERT, STAT_RENDER, STAT_READBACK, STATS };
+static const char *stat_name[STATS] = { "decode", "convert", "render", "readback" };
+static std::vector<double> stat_ms[STATS];
+static GLuint fbo, fbo_rb;
+static EGLDisplay egl_dpy = EGL_NO_DISPLAY;
+static EGLContext egl_ctx = EGL_NO_CONTEXT;
+
+/* GL 3.3 core, current without any surface */
+static int egl_open(void)
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_display) egl_dpy = get_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (egl_dpy == EGL_NO_DISPLAY) egl_dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major, minor;
+    if (egl_dpy == EGL_NO_DISPLAY || !eglInitialize(egl_dpy, &major, &minor)) {
+        fprintf(stderr, "EGL: no display\n");
+        return -1;
+    }
+    const EGLint cfg_attr[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                                EGL_NONE };
+    const EGLint ctx_attr[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+                                EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                EGL_NONE };
+    EGLConfig cfg;
+    EGLint n = 0;
+    if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(egl_dpy, cfg_attr, &cfg, 1, &n) || n < 1) {
+        fprintf(stderr, "EGL: no OpenGL config\n");
+        return -1;
+    }
+    egl_ctx = eglCreateContext(egl_dpy, cfg, EGL_NO_CONTEXT, ctx_attr);
+    if (egl_ctx == EGL_NO_CONTEXT || !eglMakeCurrent(egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_ctx)) {
+        fprintf(stderr, "EGL: cannot make a surfaceless GL 3.3 context current (0x%x)\n", eglGetError());
+        return -1;
+    }
+    printf("EGL %d.%d headless: %s\n", major, minor, (const char*)glGetString(GL_RENDERER));
+    return 0;
+}
+
+static void egl_close(void)
+{
+    if (egl_dpy == EGL_NO_DISPLAY) return;
+    eglMakeCurrent(egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (egl_ctx != EGL_NO_CONTEXT) eglDestroyContext(egl_dpy, egl_ctx);
+    eglTerminate(egl_dpy);
+}
+
+static int make_fbo(int w, int h)
+{
+    glGenFramebuffers(1, &fbo);
+    glGenRenderbuffers(1, &fbo_rb);
+    glBindRenderbuffer(GL_RENDERBUFFER, fbo_rb);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, fbo_rb);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Headless: %dx%d framebuffer incomplete\n", w, h);
+        return -1;
+    }
+    printf("Headless: rendering %dx%d\n", w, h);
+    return 0;
+}
+
+/* The bound framebuffer as top-down RGB24 */
+static void read_frame(int w, int h, std::vector<uint8_t> &rgb)
+{
+    rgb.resize((size_t)w * h * 3);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, rgb.data());
+    size_t row = (size_t)w * 3;
+    std::vector<uint8_t> tmp(row);
+    for (int y = 0; y < h / 2; ++y) {
+        uint8_t *a = &rgb[y * row], *b = &rgb[(h - 1 - y) * row];
+        memcpy(tmp.data(), a, row); memcpy(a, b, row); memcpy(b, tmp.data(), row);
+    }
+}
+
+static int write_ppm(const char *path, int w, int h, const std::vector<uint8_t> &rgb)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return -1;
+    }
+    fprintf(f, "P6\n%d %d\n255\n", w, h);
+    size_t n = fwrite(rgb.data(), 1, rgb.size(), f);
+    return fclose(f) == 0 && n == rgb.size() ? 0 : -1;
+}
+
+static void report_stats(int frames, double wall)
+{
+    printf("Headless: %d frames in %.2f s, %.1f fps\n", frames, wall, wall > 0 ? frames / wall : 0.0);
+    for (int i = 0; i < STATS; ++i) {
+        std::vector<double> &v = stat_ms[i];
+        if (v.empty()) continue;
+        std::sort(v.begin(), v.end());
+        double sum = 0.0;
+        for (double x : v) sum += x;
+        printf("  %-8s  mean %7.2f  p50 %7.2f  p95 %7.2f  p99 %7.2f  max %7.2f ms\n", stat_name[i],
+               sum / v.size(), v[v.size() / 2], v[v.size() * 95 / 100], v[v.size() * 99 / 100], v.back());
+    }
+}
+
+/* Frames are never dropped or paced: this measures the render path and
+ * makes every frame's pixels reproducible. The first --output's mesh and
+ * mask warp the picture, as on that projector. */
+static void run_headless(void)
+{
+    if (open_playback() < 0) return;
+    start_playback();
+    Output *o = noutputs ? &outputs[0] : NULL;
+    if (o && build_output(o) < 0) o = NULL;
+    if (noutputs > 1) printf("Headless: rendering output 0 of %d\n", noutputs);
+
+    std::vector<uint8_t> rgb;
+    int frames = 0, w = headless_w, h = headless_h;
+    int64_t start = av_gettime_relative();
+    while (!headless_frames || frames < headless_frames) {
+        int64_t t0 = av_gettime_relative();
+        AVFrame *frame;
+        while (!(frame = next_video_frame(cur)))
+            if (!advance_playlist()) goto end;
+        int64_t t1 = av_gettime_relative();
+        AVFrame *nv12 = convert_frame(cur, frame);
+        if (!nv12) continue;
+        int64_t t2 = av_gettime_relative();
+
+        if (!fbo) {
+            if (!w || !h) { w = nv12->width; h = nv12->height; }
+            if (make_fbo(w, h) < 0) goto end;
+        }
+        if (o) {
+            show_set(upload_frame(nv12, nv12->width, nv12->height));
+            draw_output(o, w, h);
+        } else {
+            glViewport(0, 0, w, h);
+            render_frame(nv12, nv12->width, nv12->height);
+        }
+        glFinish();
+        int64_t t3 = av_gettime_relative();
+        if (dump_pattern) {
+            char path[1024];
+            read_frame(w, h, rgb);
+            snprintf(path, sizeof(path), dump_pattern, frames);
+            write_ppm(path, w, h, rgb);
+            stat_ms[STAT_READBACK].push_back((av_gettime_relative() - t3) / 1e3);
+        }
+        stat_ms[STAT_DECODE].push_back((t1 - t0) / 1e3);
+        stat_ms[STAT_CONVERT].push_back((t2 - t1) / 1e3);
+        stat_ms[STAT_RENDER].push_back((t3 - t2) / 1e3);
+        frames++;
+    }
+
+end:
+    report_stats(frames, (av_gettime_relative() - start) / 1e6);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo); glDeleteRenderbuffers(1, &fbo_rb);
+    if (o) free_output(o);
+    close_playback();
+}
+
+/* -------------------------------------------------------------
+ *  Golden images: synthetic frames through every pixel-format path and
+ *  warp mode, compared with stored references (the ctest "golden")
+ * ------------------------------------------------------------- */
+#define GOLDEN_W 256
+#define GOLDEN_H 144
+#define GOLDEN_RUNS 20                  // timed renders per case
+#define GOLDEN_PSNR 40.0                // dB, at least
+#define GOLDEN_DE 1.0                   // mean CIE76 delta E, at most
+#define GOLDEN_SLOWDOWN 4.0             // times the recorded relative render time, at most
+#define GOLDEN_TIMES "timings.txt"      // in DIR: each case's time over the first case's
+
+enum { WARP_QUAD, WARP_MESH, WARP_BLEND };
+
+typedef struct GoldenCase {
+    const char *name;
+    enum AVPixelFormat fmt;             // source, converted as a decoded frame would be
+    int hap;                            // or a Hap texture type, uploaded as blocks
+    enum AVCodecID image;               // or written as such a file, read back as a sequence frame
+    enum AVColorSpace space;
+    enum AVColorRange range;
+    enum AVColorPrimaries primaries;
+    enum AVColorTransferCharacteristic trc;
+    int warp, max_texture;              // max_texture 0: the GL limit
+} GoldenCase;
+
+static const GoldenCase golden_cases[] = {
+    { "bt709",      AV_PIX_FMT_YUV420P,    0, AV_CODEC_ID_NONE, AVCOL_SPC_BT709, AVCOL_RANGE_MPEG,
+      AVCOL_PRI_BT709, AVCOL_TRC_BT709, WARP_QUAD, 0 },
+    { "bt601_full", AV_PIX_FMT_YUV420P,    0, AV_CODEC_ID_NONE, AVCOL_SPC_SMPTE170M, AVCOL_RANGE_JPEG,
+      AVCOL_PRI_SMPTE170M, AVCOL_TRC_BT709, WARP_QUAD, 0 },
+    { "bt2020_444", AV_PIX_FMT_YUV444P,    0, AV_CODEC_ID_NONE, AVCOL_SPC_BT2020_NCL, AVCOL_RANGE_MPEG,
+      AVCOL_PRI_BT2020, AVCOL_TRC_BT709, WARP_QUAD, 0 },
+    { "pq",         AV_PIX_FMT_YUV420P10,  0, AV_CODEC_ID_NONE, AVCOL_SPC_BT2020_NCL, AVCOL_RANGE_MPEG,
+      AVCOL_PRI_BT2020, AVCOL_TRC_SMPTE2084, WARP_QUAD, 0 },
+    { "hlg",        AV_PIX_FMT_YUV420P10,  0, AV_CODEC_ID_NONE, AVCOL_SPC_BT2020_NCL, AVCOL_RANGE_MPEG,
+      AVCOL_PRI_BT2020, AVCOL_TRC_ARIB_STD_B67, WARP_QUAD, 0 },
+    { "tiled",      AV_PIX_FMT_YUV420P,    0, AV_CODEC_ID_NONE, AVCOL_SPC_BT709, AVCOL_RANGE_MPEG,
+      AVCOL_PRI_BT709, AVCOL_TRC_BT709, WARP_QUAD, 64 },
+    { "hap_dxt1",   AV_PIX_FMT_NONE, HAP_RGB_DXT1, AV_CODEC_ID_NONE, AVCOL_SPC_RGB, AVCOL_RANGE_JPEG,
+      AVCOL_PRI_BT709, AVCOL_TRC_BT709, WARP_QUAD, 0 },
+    { "hap_q",      AV_PIX_FMT_NONE, HAP_YCOCG_DXT5, AV_CODEC_ID_NONE, AVCOL_SPC_RGB, AVCOL_RANGE_JPEG,
+      AVCOL_PRI_BT709, AVCOL_TRC_BT709, WARP_QUAD, 0 },
+    { "mesh",       AV_PIX_FMT_YUV420P,    0, AV_CODEC_ID_NONE, AVCOL_SPC_BT709, AVCOL_RANGE_MPEG,
+      AVCOL_PRI_BT709, AVCOL_TRC_BT709, WARP_MESH, 0 },
+    { "blend",      AV_PIX_FMT_YUV420P,    0, AV_CODEC_ID_NONE, AVCOL_SPC_BT709, AVCOL_RANGE_MPEG,
+      AVCOL_PRI_BT709, AVCOL_TRC_BT709, WARP_BLEND, 0 },
+    { "rgb",        AV_PIX_FMT_RGB24,      0, AV_CODEC_ID_NONE, AVCOL_SPC_RGB, AVCOL_RANGE_JPEG,
+      AVCOL_PRI_BT709, AVCOL_TRC_IEC61966_2_1, WARP_QUAD, 0 },
+    { "seq_exr",    AV_PIX_FMT_GBRPF32LE,  0, AV_CODEC_ID_EXR, AVCOL_SPC_RGB, AVCOL_RANGE_JPEG,
+      AVCOL_PRI_BT709, AVCOL_TRC_LINEAR, WARP_QUAD, 0 },
+};
+
+/* Test pattern at (u, v) in [0,1): a ramp above and eight steps below in
+ * luma, chroma ramped across and down, so edges and gradients both show */
+static double golden_pattern(int plane, double u, double v)
+{
+    if (plane == 0) return v < 0.5 ? u : floor(u * 8) / 7;
+    return plane == 1 ? u : 1.0 - v;
+}
+
+static int golden_yuv(AVFrame *f, const GoldenCase *g)
+{
+    f->format = g->fmt;
+    if (av_frame_get_buffer(f, 0) < 0) return -1;
+    const AVPixFmtDescriptor *d = av_pix_fmt_desc_get(g->fmt);
+    int depth = d->comp[0].depth;
+    bool full = g->range == AVCOL_RANGE_JPEG;
+    for (int p = 0; p < 3; ++p) {
+        int sx = p ? d->log2_chroma_w : 0, sy = p ? d->log2_chroma_h : 0;
+        int w = (GOLDEN_W + (1 << sx) - 1) >> sx, h = (GOLDEN_H + (1 << sy) - 1) >> sy;
+        double lo = full ? 0 : 16 << (depth - 8);
+        double span = full ? (1 << depth) - 1 : (p ? 224 : 219) << (depth - 8);
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x) {
+                int c = (int)(lo + span * golden_pattern(p, (double)(x << sx) / GOLDEN_W,
+                                                         (double)(y << sy) / GOLDEN_H) + 0.5);
+                if (depth > 8) ((uint16_t*)(f->data[p] + (size_t)y * f->linesize[p]))[x] = (uint16_t)c;
+                else f->data[p][(size_t)y * f->linesize[p] + x] = (uint8_t)c;
+            }
+    }
+    return 0;
+}
+
+/* RGB: the pattern's three planes as R, G, B, sRGB-encoded, or in
+ * linear light for a linear source */
+static int golden_rgb(AVFrame *f, const GoldenCase *g)
+{
+    static const int gbr[3] = { 2, 0, 1 };     // planar RGB is stored G, B, R
+    f->format = g->fmt;
+    if (av_frame_get_buffer(f, 0) < 0) return -1;
+    bool planar = av_pix_fmt_desc_get(g->fmt)->flags & AV_PIX_FMT_FLAG_PLANAR;
+    for (int y = 0; y < GOLDEN_H; ++y)
+        for (int x = 0; x < GOLDEN_W; ++x)
+            for (int k = 0; k < 3; ++k) {
+                double c = golden_pattern(k, (double)x / GOLDEN_W, (double)y / GOLDEN_H);
+                if (g->trc == AVCOL_TRC_LINEAR)
+                    c = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+                if (planar)
+                    ((float*)(f->data[gbr[k]] + (size_t)y * f->linesize[gbr[k]]))[x] = (float)c;
+                else
+                    f->data[0][(size_t)y * f->linesize[0] + x * 3 + k] = (uint8_t)(c * 255 + 0.5);
+            }
+    return 0;
+}
+
+/* A sequence frame: src encoded to an image file in the working
+ * directory and decoded back the way seq_worker decodes it */
+static AVFrame *golden_image(const AVFrame *src, enum AVCodecID id, const char *name)
+{
+    const AVCodec *codec = avcodec_find_encoder(id);
+    AVCodecContext *enc = codec ? avcodec_alloc_context3(codec) : NULL;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *img = NULL;
+    FILE *f = NULL;
+    char path[256];
+    snprintf(path, sizeof(path), "golden_%s.%s", name, codec ? codec->name : "img");
+    if (!enc || !pkt) goto done;
+    enc->width = src->width;
+    enc->height = src->height;
+    enc->pix_fmt = (enum AVPixelFormat)src->format;
+    enc->time_base = AVRational{ 1, 25 };
+    if (avcodec_open2(enc, codec, NULL) < 0 || avcodec_send_frame(enc, src) < 0 ||
+        avcodec_send_frame(enc, NULL) < 0 || avcodec_receive_packet(enc, pkt) < 0 ||
+        !(f = fopen(path, "wb")))
+        goto done;
+    if (fwrite(pkt->data, 1, pkt->size, f) == (size_t)pkt->size && fclose(f) == 0)
+        img = load_image(path, true);
+    else
+        fclose(f);
+    unlink(path);
+done:
+    if (!img) fprintf(stderr, "%s: cannot write and read back %s\n", name, path);
+    av_packet_free(&pkt);
+    avcodec_free_context(&enc);
+    return img;
+}
+
+/* Hap frames as hap_unpack leaves them: one flat colour per 4x4 block.
+ * Hap Q holds scaled YCoCg (scale 1): Co, Cg in the colour endpoints, Y
+ * in the alpha block. */
+static int golden_hap(AVFrame *f, int tex)
+{
+    int bw = GOLDEN_W / 4, bh = GOLDEN_H / 4, block = tex == HAP_RGB_DXT1 ? 8 : 16;
+    f->buf[0] = av_buffer_alloc((size_t)bw * bh * block);
+    if (!f->buf[0]) return -1;
+    f->data[0] = f->buf[0]->data;
+    f->linesize[0] = bw * block;
+    f->format = AV_PIX_FMT_NONE;
+    f->opaque = (void*)(intptr_t)tex;
+    memset(f->data[0], 0, f->buf[0]->size);
+    for (int by = 0; by < bh; ++by)
+        for (int bx = 0; bx < bw; ++bx) {
+            double u = (bx * 4 + 2.0) / GOLDEN_W, v = (by * 4 + 2.0) / GOLDEN_H;
+            double r = golden_pattern(0, u, v), g = golden_pattern(1, u, v), b = golden_pattern(2, u, v);
+            uint8_t *p = f->data[0] + (size_t)by * f->linesize[0] + (size_t)bx * block;
+            uint16_t c;
+            if (tex == HAP_RGB_DXT1) {
+                c = (uint16_t)((int)(r * 31 + 0.5) << 11 | (int)(g * 63 + 0.5) << 5 | (int)(b * 31 + 0.5));
+            } else {
+                p[0] = p[1] = (uint8_t)((r + 2 * g + b) / 4 * 255 + 0.5);
+                double co = (r - b) / 2 + 0.5, cg = (2 * g - r - b) / 4 + 0.5;
+                c = (uint16_t)((int)(co * 31 + 0.5) << 11 | (int)(cg * 63 + 0.5) << 5);
+                p += 8;
+            }
+            p[0] = p[2] = c & 0xff;     // both endpoints, every index 0
+            p[1] = p[3] = c >> 8;
+        }
+    return 0;
+}
+
+static AVFrame *golden_frame(const GoldenCase *g)
+{
+    AVFrame *f = av_frame_alloc();
+    if (!f) return NULL;
+    f->width = GOLDEN_W;
+    f->height = GOLDEN_H;
+    const AVPixFmtDescriptor *d = g->hap ? NULL : av_pix_fmt_desc_get(g->fmt);
+    int ret = g->hap ? golden_hap(f, g->hap) :
+              d->flags & AV_PIX_FMT_FLAG_RGB ? golden_rgb(f, g) : golden_yuv(f, g);
+    if (ret < 0) {
+        av_frame_free(&f);
+        return NULL;
+    }
+    if (g->image) {                     // tagged by the decoder, as a real file is
+        AVFrame *img = golden_image(f, g->image, g->name);
+        av_frame_free(&f);
+        return img;
+    }
+    f->colorspace = g->space;
+    f->color_range = g->range;
+    f->color_primaries = g->primaries;
+    f->color_trc = g->trc;
+    return f;
+}
+
+/* A barrel-shaped mesh with brightness falling off to the right, or a
+ * quad behind a soft right-hand edge blend with per-channel black lift */
+static void golden_output(Output *o, int warp)
+{
+    for (int k = 0; k < 3; ++k) { o->gamma[k] = 2.2f; o->black[k] = 0.0f; }
+    if (warp != WARP_MESH) {
+        build_output(o);
+    } else {
+        const int nx = 17, ny = 9;
+        std::vector<float> verts;
+        std::vector<unsigned int> idx;
+        for (int j = 0; j < ny; ++j)
+            for (int i = 0; i < nx; ++i) {
+                float u = i / (nx - 1.0f), v = j / (ny - 1.0f), x = 2 * u - 1, y = 2 * v - 1;
+                float k = 1.0f - 0.15f * (x * x + y * y);
+                float node[] = { x * k, y * k, u, v, 1.0f - 0.4f * u * u };
+                verts.insert(verts.end(), node, node + 5);
+            }
+        for (int j = 0; j + 1 < ny; ++j)
+            for (int i = 0; i + 1 < nx; ++i) {
+                unsigned int a = j * nx + i, b = a + 1, c = a + nx, d = c + 1;
+                unsigned int quad[] = { a, b, c, b, d, c };
+                idx.insert(idx.end(), quad, quad + 6);
+            }
+        make_mesh(verts.data(), nx * ny, idx.data(), (int)idx.size(), &o->vao, &o->vbo, &o->ebo);
+        o->count = (GLsizei)idx.size();
+    }
+    if (warp != WARP_BLEND) return;
+
+    std::vector<uint16_t> mask((size_t)GOLDEN_W * GOLDEN_H * 3);
+    for (int y = 0; y < GOLDEN_H; ++y)
+        for (int x = 0; x < GOLDEN_W; ++x) {
+            double t = fmin(fmax((x / (GOLDEN_W - 1.0) - 0.6) / 0.4, 0.0), 1.0);
+            uint16_t m = (uint16_t)((1.0 - t * t * (3 - 2 * t)) * 65535 + 0.5);
+            for (int k = 0; k < 3; ++k) mask[((size_t)y * GOLDEN_W + x) * 3 + k] = m;
+        }
+    glGenTextures(1, &o->mask);
+    glBindTexture(GL_TEXTURE_2D, o->mask);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, GOLDEN_W, GOLDEN_H, 0, GL_RGB, GL_UNSIGNED_SHORT, mask.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    o->black[0] = 0.05f; o->black[1] = 0.04f; o->black[2] = 0.06f;
+}
+
+static bool read_ppm(const char *path, int w, int h, std::vector<uint8_t> &rgb)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return false;
+    int pw, ph, max;
+    bool ok = fscanf(f, "P6 %d %d %d", &pw, &ph, &max) == 3 && fgetc(f) != EOF &&
+              pw == w && ph == h && max == 255;
+    if (ok) {
+        rgb.resize((size_t)w * h * 3);
+        ok = fread(rgb.data(), 1, rgb.size(), f) == rgb.size();
+    }
+    fclose(f);
+    return ok;
+}
+
+static double lab_f(double t)
+{
+    return t > 216.0 / 24389.0 ? cbrt(t) : (24389.0 / 27.0 * t + 16.0) / 116.0;
+}
+
+/* sRGB (8 bits) to CIELAB, D65 */
+static void srgb_lab(const uint8_t *p, double lab[3])
+{
+    double c[3];
+    for (int k = 0; k < 3; ++k) {
+        double v = p[k] / 255.0;
+        c[k] = v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+    }
+    double x = lab_f((0.4124 * c[0] + 0.3576 * c[1] + 0.1805 * c[2]) / 0.95047);
+    double y = lab_f(0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2]);
+    double z = lab_f((0.0193 * c[0] + 0.1192 * c[1] + 0.9505 * c[2]) / 1.08883);
+    lab[0] = 116.0 * y - 16.0;
+    lab[1] = 500.0 * (x - y);
+    lab[2] = 200.0 * (y - z);
+}
+
+static void golden_compare(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b,
+                           double *psnr, double *de_mean, double *de_max)
+{
+    double se = 0.0, de_sum = 0.0;
+    *de_max = 0.0;
+    for (size_t i = 0; i < a.size(); i += 3) {
+        double la[3], lb[3];
+        for (int k = 0; k < 3; ++k) se += (double)(a[i + k] - b[i + k]) * (a[i + k] - b[i + k]);
+        srgb_lab(&a[i], la);
+        srgb_lab(&b[i], lb);
+        double de = sqrt((la[0] - lb[0]) * (la[0] - lb[0]) + (la[1] - lb[1]) * (la[1] - lb[1]) +
+                         (la[2] - lb[2]) * (la[2] - lb[2]));
+        de_sum += de;
+        if (de > *de_max) *de_max = de;
+    }
+    double mse = se / a.size();
+    *psnr = mse > 0 ? 10.0 * log10(255.0 * 255.0 / mse) : INFINITY;
+    *de_mean = de_sum / (a.size() / 3);
+}
+
+/* Relative render time recorded with the references, 0 if there is none */
+static double golden_recorded(const char *dir, const char *name)
+{
+    char path[4096], n[64];
+    double rel, found = 0.0;
+    snprintf(path, sizeof(path), "%s/" GOLDEN_TIMES, dir);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0.0;
+    while (fscanf(f, "%63s %lf", n, &rel) == 2)
+        if (!strcmp(n, name)) found = rel;
+    fclose(f);
+    return found;
+}
+
+/* Each case is converted, uploaded and drawn GOLDEN_RUNS times after one
+ * untimed warm-up (shader compilation, first allocations); the mean is
+ * its render time. Times are kept relative to the first case's, which
+ * carries over between machines far better than milliseconds, so a fresh
+ * CI runner checks them too. update: write the references and relative
+ * times of the cases that rendered instead of checking them. A missing
+ * reference or time fails. Returns the process exit code. */
+static int run_golden(const char *dir, bool update)
+{
+    if (make_fbo(GOLDEN_W, GOLDEN_H) < 0) return 1;
+    Clip conv = {};
+    conv.swframe = av_frame_alloc();
+    conv.nv12 = av_frame_alloc();
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/" GOLDEN_TIMES, dir);
+    FILE *times = update ? fopen(path, "w") : NULL;
+    if (update && !times) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return 1;
+    }
+
+    int failed = 0, missing = 0;
+    double base_ms = 0.0;               // the first case's
+    GLint limit = max_texture;
+    std::vector<uint8_t> out, ref;
+    for (const GoldenCase &g : golden_cases) {
+        if (g.hap && !GLEW_EXT_texture_compression_s3tc) {
+            printf("%-12s skipped, no S3TC\n", g.name);
+            continue;
+        }
+        AVFrame *src = golden_frame(&g);
+        if (!src) { failed++; continue; }
+        Output o = {};
+        golden_output(&o, g.warp);
+        max_texture = g.max_texture ? g.max_texture : limit;
+
+        double ms = 0.0;
+        int r;
+        for (r = -1; r < GOLDEN_RUNS; ++r) {
+            int64_t t0 = av_gettime_relative();
+            AVFrame *f = convert_frame(&conv, src);
+            if (!f) break;
+            show_set(upload_frame(f, f->width, f->height));
+            draw_output(&o, GOLDEN_W, GOLDEN_H);
+            glFinish();
+            if (r >= 0) ms += (av_gettime_relative() - t0) / 1e3;
+        }
+        ms /= GOLDEN_RUNS;
+        read_frame(GOLDEN_W, GOLDEN_H, out);
+        max_texture = limit;
+        free_output(&o);
+        av_frame_free(&src);
+        if (r < GOLDEN_RUNS) {
+            printf("%-12s FAIL  cannot convert the frame\n", g.name);
+            failed++;
+            continue;
+        }
+        if (!base_ms) base_ms = ms;
+        double rel = ms / base_ms;
+
+        snprintf(path, sizeof(path), "%s/%s.ppm", dir, g.name);
+        if (update) {
+            if (write_ppm(path, GOLDEN_W, GOLDEN_H, out) < 0) failed++;
+            else fprintf(times, "%s %.3f\n", g.name, rel);
+            printf("%-12s written, %.2f ms, %.2fx %s\n", g.name, ms, rel, golden_cases[0].name);
+            continue;
+        }
+        if (!read_ppm(path, GOLDEN_W, GOLDEN_H, ref)) {
+            printf("%-12s FAIL  no reference, rendered to %s.new.ppm\n", g.name, g.name);
+            snprintf(path, sizeof(path), "%s.new.ppm", g.name);
+            write_ppm(path, GOLDEN_W, GOLDEN_H, out);
+            missing++;
+            continue;
+        }
+        double psnr, de_mean, de_max, was = golden_recorded(dir, g.name);
+        golden_compare(out, ref, &psnr, &de_mean, &de_max);
+        bool bad = psnr < GOLDEN_PSNR || de_mean > GOLDEN_DE || !was || rel > GOLDEN_SLOWDOWN * was;
+        printf("%-12s %s  PSNR %6.2f dB  dE mean %.2f max %.2f  %.2f ms, %.2fx (recorded %.2fx)\n", g.name,
+               bad ? "FAIL" : "ok  ", psnr, de_mean, de_max, ms, rel, was);
+        if (bad) {
+            snprintf(path, sizeof(path), "%s.fail.ppm", g.name);
+            write_ppm(path, GOLDEN_W, GOLDEN_H, out);
+            failed++;
+        }
+    }
+
+    if (times) fclose(times);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo); glDeleteRenderbuffers(1, &fbo_rb);
+    av_frame_free(&conv.swframe);
+    av_frame_free(&conv.nv12);
+    sws_freeContext(conv.sws);
+    printf("Golden: %d failed, %d without reference\n", failed, missing);
+    return failed || missing ? 1 : 0;
+}
+#endif
+
+/* -------------------------------------------------------------
+ *  Keyboard: space play/pause, J/K/L reverse/pause/play (J and L again
+ *  double the speed, K resets it), arrows step
+ * ------------------------------------------------------------- */
+static void key_callback(GLFWwindow *w, int key, int scancode, int action, int mods)
+{
+    if (action != GLFW_PRESS && action != GLFW_REPEAT) return;
+    switch (key) {
+    case GLFW_KEY_SPACE:
+        transport_request = transport == TRANSPORT_PLAY ? TRANSPORT_PAUSE : TRANSPORT_PLAY;
+        break;
+    case GLFW_KEY_J:    /* pressed again: faster */
+        if (transport == TRANSPORT_REVERSE && speed < SPEED_MAX) speed_request = speed * 2;
+        transport_request = TRANSPORT_REVERSE;
+        break;
+    case GLFW_KEY_K:
+        transport_request = TRANSPORT_PAUSE;
+        speed_request = 1.0;
+        break;
+    case GLFW_KEY_L:
+        if (transport == TRANSPORT_PLAY && speed < SPEED_MAX) speed_request = speed * 2;
+        transport_request = TRANSPORT_PLAY;
+        break;
+    case GLFW_KEY_LEFT:  transport_request = TRANSPORT_PAUSE; step_request = -1; break;
+    case GLFW_KEY_RIGHT: transport_request = TRANSPORT_PAUSE; step_request = 1; break;
+    }
 }
 
 /* -------------------------------------------------------------
  *  Main
  * ------------------------------------------------------------- */
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options] <video> [<video> ...]\n"
+        "  --loop              loop the clip (or the whole playlist) seamlessly\n"
+        "  --preload           read each clip into locked RAM before playing it\n"
+        "  --preload-limit MB  largest file --preload accepts (default 2048)\n"
+        "  --readahead MB      read asynchronously this far ahead of the demuxer\n"
+        "  --direct            stream with O_DIRECT (double-buffered unless\n"
+        "                      --readahead is given), keeping the page cache clean\n"
+        "  --split-readers     demux audio with its own reader (badly interleaved files)\n"
+        "  --video-stream N    play video stream N\n"
+        "  --audio-stream S    play audio stream S, an index or a language (eng, deu...)\n"
+        "  --adaptive          skip loop filter / non-reference / non-key frames\n"
+        "                      while the decoder cannot keep up\n"
+        "  --cache-mb MB       frame cache for pause, stepping and reverse (default 1024)\n"
+        "  --speed X           playback speed, 0.5 to 4 (default 1)\n"
+        "  --audio-latency MS  delay after the audio device (receiver, HDMI), added to\n"
+        "                      its buffer when video follows the audio clock\n"
+        "  --drift-comp MS     keep video on the system clock and resample the audio\n"
+        "                      to follow it, within MS\n"
+        "  --output M[:MESH[:MASK]]\n"
+        "                      projector output on monitor M (-1: a window), warped by\n"
+        "                      a Bourke mesh file and blended by a mask image; repeat\n"
+        "                      for each projector (up to 8)\n"
+        "  --output-gamma G    gamma of the last output's projector, G or R,G,B (2.2)\n"
+        "  --output-black B    black-level lift of the last output, B or R,G,B (0)\n"
+        "  --tonemap OP        HDR to SDR: clip, reinhard, hable or bt2390 (default)\n"
+        "  --sdr-white NITS    HDR level shown as SDR white (default 203)\n"
+        "  --max-texture N     tile planes wider or taller than N (default: GL limit)\n"
+        "  --upload-thread     upload frames on a second thread with a shared context\n"
+        "  --fps F             frame rate of image sequences (name_%%05d.exr)\n"
+        "  --mosaic CxR        the files are C columns by R rows of one picture\n"
+        "                      (row by row from the top left), played frame-locked\n"
+        "  --headless WxH      render offscreen (EGL) into a WxH framebuffer (0x0: the\n"
+        "                      video's size), every frame, and print frame times\n"
+        "  --frames N          headless: stop after N frames\n"
+        "  --dump PATTERN      headless: read each frame back into a PPM (out_%%05d.ppm)\n"
+        "  --golden DIR        render the test cases offscreen and compare them with the\n"
+        "                      references in DIR (--golden-update DIR writes them)\n"
+        "Keys: space play/pause, J/K/L reverse/pause/play (J/L again: 2x faster),\n"
+        "      left/right step a frame\n",
+        prog);
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <video>\n", argv[0]);
+    int arg = 1;
+    bool window_set = false;
+    for (; arg < argc && !strncmp(argv[arg], "--", 2); ++arg) {
+        if (!strcmp(argv[arg], "--loop")) loop_mode = true;
+        else if (!strcmp(argv[arg], "--preload")) io_backend = &preload_io;
+        else if (!strcmp(argv[arg], "--preload-limit") && arg + 1 < argc)
+            preload_limit = (int64_t)(atof(argv[++arg]) * 1048576.0);
+        else if (!strcmp(argv[arg], "--readahead") && arg + 1 < argc) {
+            io_backend = &readahead_io;
+            readahead_blocks = atoi(argv[++arg]) / (RA_BLOCK_SIZE >> 20);
+            if (readahead_blocks < 2) readahead_blocks = 2;
+            window_set = true;
+        }
+        else if (!strcmp(argv[arg], "--split-readers")) split_readers = true;
+        else if (!strcmp(argv[arg], "--adaptive")) adaptive = true;
+        else if (!strcmp(argv[arg], "--upload-thread")) upload_thread = true;
+        else if (!strcmp(argv[arg], "--drift-comp") && arg + 1 < argc)
+            drift_tolerance = fmax(atof(argv[++arg]), 0.1) / 1000.0;
+        else if (!strcmp(argv[arg], "--audio-latency") && arg + 1 < argc)
+            audio_latency_extra = atof(argv[++arg]) / 1000.0;
+        else if (!strcmp(argv[arg], "--speed") && arg + 1 < argc)
+            speed = fmin(fmax(atof(argv[++arg]), SPEED_MIN), SPEED_MAX);
+        else if (!strcmp(argv[arg], "--output") && arg + 1 < argc) {
+            if (!add_output(argv[++arg])) { usage(argv[0]); return 1; }
+        }
+        else if ((!strcmp(argv[arg], "--output-gamma") || !strcmp(argv[arg], "--output-black")) &&
+                 arg + 1 < argc) {
+            bool gamma = !strcmp(argv[arg], "--output-gamma");
+            if (!set_output_rgb(argv[++arg], gamma)) { usage(argv[0]); return 1; }
+        }
+        else if (!strcmp(argv[arg], "--tonemap") && arg + 1 < argc) {
+            for (tonemap = 0; tonemap < TONEMAPS && strcmp(argv[arg + 1], tonemap_name[tonemap]); ++tonemap) {}
+            if (tonemap == TONEMAPS) { usage(argv[0]); return 1; }
+            ++arg;
+        }
+        else if (!strcmp(argv[arg], "--sdr-white") && arg + 1 < argc)
+            sdr_white = (float)atof(argv[++arg]);
+        else if (!strcmp(argv[arg], "--max-texture") && arg + 1 < argc)
+            max_texture = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "--mosaic") && arg + 1 < argc) {
+            if (sscanf(argv[++arg], "%dx%d", &mosaic_cols, &mosaic_rows) != 2 ||
+                mosaic_cols < 1 || mosaic_rows < 1) { usage(argv[0]); return 1; }
+        }
+        else if (!strcmp(argv[arg], "--headless") && arg + 1 < argc) {
+            if (sscanf(argv[++arg], "%dx%d", &headless_w, &headless_h) != 2 ||
+                headless_w < 0 || headless_h < 0) { usage(argv[0]); return 1; }
+            headless = true;
+        }
+        else if ((!strcmp(argv[arg], "--golden") || !strcmp(argv[arg], "--golden-update")) &&
+                 arg + 1 < argc) {
+            golden_update = !strcmp(argv[arg], "--golden-update");
+            golden_dir = argv[++arg];
+        }
+        else if (!strcmp(argv[arg], "--frames") && arg + 1 < argc)
+            headless_frames = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "--dump") && arg + 1 < argc)
+            dump_pattern = argv[++arg];
+        else if (!strcmp(argv[arg], "--fps") && arg + 1 < argc)
+            seq_fps = atof(argv[++arg]);
+        else if (!strcmp(argv[arg], "--cache-mb") && arg + 1 < argc)
+            cache_budget = (size_t)atoi(argv[++arg]) << 20;
+        else if (!strcmp(argv[arg], "--video-stream") && arg + 1 < argc) vstream_sel = argv[++arg];
+        else if (!strcmp(argv[arg], "--audio-stream") && arg + 1 < argc) astream_sel = argv[++arg];
+        else if (!strcmp(argv[arg], "--direct")) {
+            io_backend = &readahead_io;
+            readahead_direct = true;
+        }
+        else { usage(argv[0]); return 1; }
+    }
+    if (golden_dir) {
+#ifdef HAVE_EGL
+        int ret = egl_open() < 0;
+        if (!ret) {
+            init_gl();
+            ret = run_golden(golden_dir, golden_update);
+            free_gl();
+        }
+        egl_close();
+        return ret;
+#else
+        fprintf(stderr, "--golden: built without EGL\n");
+        return 1;
+#endif
+    }
+    if (arg >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (readahead_direct && !window_set) readahead_blocks = 2;
+    if (mosaic_cols && argc - arg != mosaic_cols * mosaic_rows) {
+        fprintf(stderr, "--mosaic %dx%d needs %d files\n", mosaic_cols, mosaic_rows, mosaic_cols * mosaic_rows);
+        return 1;
+    }
+    playlist = (const char **)(argv + arg);
+    playlist_len = argc - arg;
+
+    if (headless) {
+#ifdef HAVE_EGL
+        int ret = egl_open();
+        if (ret == 0) {
+            init_gl();
+            run_headless();
+            free_gl();
+        }
+        egl_close();
+        return ret < 0;
+#else
+        fprintf(stderr, "--headless: built without EGL\n");
         return 1;
+#endif
     }
 
     if (SDL_Init(SDL_INIT_AUDIO) < 0) {
@@ -402,6 +4593,8 @@ int main(int argc, char **argv)
     glfwMakeContextCurrent(win);
     glfwSwapInterval(1);
 
+    glfwSetKeyCallback(win, key_callback);  // before ImGui, which chains it
+
     // ImGui
     IMGUI_CHECKVERSION();
     ImGui::CreateContext();
@@ -409,16 +4602,16 @@ int main(int argc, char **argv)
     ImGui_ImplOpenGL3_Init("#version 330");
 
     init_gl();
-    run(win, argv[1]);
+    if (open_outputs(win) == 0 && start_upload_thread(win) == 0) run(win);
+    stop_upload_thread();
+    close_outputs(win);
 
     // Cleanup
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
 
-    glDeleteTextures(1, &texY); glDeleteTextures(1, &texU); glDeleteTextures(1, &texV);
-    glDeleteVertexArrays(1, &vao); glDeleteBuffers(1, &vbo); glDeleteBuffers(1, &ebo);
-    glDeleteProgram(prog);
+    free_gl();
 
     glfwDestroyWindow(win);
     glfwTerminate();